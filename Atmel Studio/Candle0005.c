@@ -22,50 +22,205 @@
 // TODO: Once everything is done, could set Watchdog fuse and then would not have to have code to turn it on at power up. Might also preserve the prescaler between resets, saving more time and code
 // TODO: Once everything is done, could clear the the CLK/8 bit and have chip startup running fast and not have to do in code on every wake. 
 
-// TODO: Maybe try to get everything running with fuze-set 4mhz so that we can run battery down to 2.7 volts 
-
-#define F_CPU 8000000UL  // We will be at 8 MHz once we get all booted up and get rid of the prescaler
-
 #include <avr/io.h>
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
 #include <avr/sleep.h>
 #include <avr/wdt.h>				// Watchdog Functions
+#include <avr/eeprom.h>
 #include <string.h>					// memset()
 
 #include "candle.h"
-#include "videoBitstream.h"
+#include "VideoBitstream.h"
+
+#ifdef GOVERNOR
+	#include <util/delay.h>			// _delay_us() needs F_CPU from candle.h
+#endif
+
+#if VIDEOBITSTREAM_FORMAT != BITSTREAM_FORMAT
+	#error "VideoBitStream.c was encoded in a different format than BITSTREAM_FORMAT in candle.h. Re-run the encoder with the matching -f option."
+#endif
+
+// The clocks we can get straight from the fuses, so there is nothing to set up on each wake.
+// CLOCK_PRESCALE is what DEBUG builds (which start at clock/8) put in CLKPR to get up to F_CPU.
+
+#if F_CPU == 8000000UL
+	#define CLOCK_FUSES ( FUSE_CKSEL3 & FUSE_CKSEL1 & FUSE_CKSEL0 )					// 8Mhz internal RC
+	#define CLOCK_PRESCALE 0
+#elif F_CPU == 4000000UL
+	#define CLOCK_FUSES ( FUSE_CKSEL3 & FUSE_CKSEL2 & FUSE_CKSEL0 )					// 4Mhz internal RC
+	#define CLOCK_PRESCALE 0
+#elif F_CPU == 1000000UL
+	#define CLOCK_FUSES ( FUSE_CKDIV8 & FUSE_CKSEL3 & FUSE_CKSEL1 & FUSE_CKSEL0 )	// 8Mhz internal RC, clock/8
+	#define CLOCK_PRESCALE ( _BV(CLKPS1) | _BV(CLKPS0) )							// Stay at clock/8
+#else
+	#error "F_CPU has to be 8000000UL, 4000000UL or 1000000UL, the clocks the fuses can give us"
+#endif
 
 #ifndef DEBUG
 	FUSES = {
-		.low = (FUSE_SUT1 & FUSE_SUT0 & FUSE_CKSEL3 & FUSE_CKSEL1 & FUSE_CKSEL0),						// Startup with full speed, no startup delay, 8Mhz internal RC
+		.low = (FUSE_SUT1 & FUSE_SUT0 & CLOCK_FUSES),						// Startup at F_CPU, no startup delay
 		.high =  HFUSE_DEFAULT,
 		.extended = EFUSE_DEFAULT
 	};
 #else
 	FUSES = {
-		.low = (FUSE_CKDIV8 & FUSE_SUT1 & FUSE_SUT0 & FUSE_CKSEL3 & FUSE_CKSEL1 & FUSE_CKSEL0),			// Startup with clock/8, no startup delay, 8Mhz internal RC
+		.low = (FUSE_CKDIV8 & FUSE_SUT1 & FUSE_SUT0 & CLOCK_FUSES),			// Startup with clock/8, no startup delay
 		.high =  HFUSE_DEFAULT,
 		.extended = EFUSE_DEFAULT
 	};
 #endif
 
 
-// Convert 5 bit brightness into 8 bit LED duty cycle
-// Note that we could keep this in program memory but we have plenty of static RAM right now 
-// and this way makes slightly smaller code
+// Convert 5 bit brightness into LED duty cycle. 8 bits unless FULL_ON_DUTYCYCLE in candle.h says otherwise
+// The table is in flash rather than RAM, and getDutyCycle() reads it through pgm_read_dutycycle_near()
 
 #define DUTY_CYCLE_SIZE (1<<BRIGHTNESSBITS)
-#define FULL_ON_DUTYCYCLE 255	// how much is a full on LED?
 
-const byte brightness2Dutycycle[DUTY_CYCLE_SIZE] = {
-	0,     1 ,     2,     3,     4,     5,     7,     9,    12,
-	15,    18,    22,    27,    32,    38,    44,    51,    58,
-	67,    76,    86,    96,   108,   120,   134,   148,   163,
-	180,   197,   216,   235,   255,
+// Duty cycles are all worked out in 8Mhz cycles. At a slower clock each cycle is longer, so they get divided down to keep
+// the same on-times. Anything that was on stays on for at least a cycle, so the dimmest levels bunch up at 1Mhz.
+// The ledDutyCycle() loops count cycles, so they don't need to know.
+
+#define CLOCK_SCALE ( 8000000UL / F_CPU )
+#define SCALED_DUTY(d) ( (d) == 0 ? 0 : (d) <= CLOCK_SCALE ? 1 : ( (d) + CLOCK_SCALE/2 ) / CLOCK_SCALE )
+
+#if ( WIDTH * HEIGHT * SCALED_DUTY(FULL_ON_DUTYCYCLE) ) > ( F_CPU / REFRESH_RATE / 2 )
+	#error "FULL_ON_DUTYCYCLE is too big. With every LED full on, a refresh would take more than half of each wake."
+#endif
+
+#if FULL_ON_DUTYCYCLE == 255
+
+typedef byte dutycycle;
+
+#define BRIGHTEST_DUTYCYCLE SCALED_DUTY(FULL_ON_DUTYCYCLE)
+
+#ifdef DITHER
+
+// The bottom half of the levels are dither codes rather than cycle counts. refreshScreenClean() looks each one up in
+// ditherQuarters[] and alternates between the cycle counts either side across refreshes, so they come out in quarter cycles.
+// Code 0 is still off. Real cycle counts start at DITHER_CODES, so one compare tells them apart.
+
+#define DITHER_CODES 16
+
+static byte const PROGMEM brightness2Dutycycle[DUTY_CYCLE_SIZE] = {
+	0,     1,     2,     3,     4,     5,     6,     7,     8,
+	9,    10,    11,    12,    13,    14,    15,    17,    20,
+	24,   29,    35,    42,    50,    60,    72,    86,   103,
+	124,  148,   177,   213,   255,
+};
+
+// How many quarter cycles each dither code averages out to. 0.5 up to 3.5 cycles in half cycle steps, then a bit wider up to 14.5.
+
+static byte const PROGMEM ditherQuarters[DITHER_CODES] = {
+	0,     2,     4,     6,     8,    10,    12,    14,
+	17,   20,    24,    28,    34,    40,    48,    58,
+};
+
+byte ditherPhase;			// Counts refreshes, so which of the 4 refreshes in the dither pattern this is
+
+#else
+
+static byte const PROGMEM brightness2Dutycycle[DUTY_CYCLE_SIZE] = {
+	SCALED_DUTY(0), SCALED_DUTY(1), SCALED_DUTY(2), SCALED_DUTY(3),
+	SCALED_DUTY(4), SCALED_DUTY(5), SCALED_DUTY(7), SCALED_DUTY(9),
+	SCALED_DUTY(12), SCALED_DUTY(15), SCALED_DUTY(18), SCALED_DUTY(22),
+	SCALED_DUTY(27), SCALED_DUTY(32), SCALED_DUTY(38), SCALED_DUTY(44),
+	SCALED_DUTY(51), SCALED_DUTY(58), SCALED_DUTY(67), SCALED_DUTY(76),
+	SCALED_DUTY(86), SCALED_DUTY(96), SCALED_DUTY(108), SCALED_DUTY(120),
+	SCALED_DUTY(134), SCALED_DUTY(148), SCALED_DUTY(163), SCALED_DUTY(180),
+	SCALED_DUTY(197), SCALED_DUTY(216), SCALED_DUTY(235), SCALED_DUTY(255),
 };
 
-#define getDutyCycle(b) (brightness2Dutycycle[b])
+#endif
+
+#else
+
+// Past 255 the table comes from a curve instead. The linear part keeps every level at least a cycle brighter than the one
+// below it, and the cubic part bends it up for the eye. 29791 is 31^3, so level 31 comes out at exactly FULL_ON_DUTYCYCLE.
+// No casts, so #if can use it too.
+
+#if BRIGHTNESSBITS != 5
+	#error "DUTY_CURVE() is worked out for 32 brightness levels"
+#endif
+
+#define DUTY_CURVE(b) ( (b) + ( (FULL_ON_DUTYCYCLE-31L) * (b)*(b)*(b) ) / 29791L )
+
+// Duty cycles only need to be words if the clip actually uses a level that comes out past 255. Streams from before the
+// encoder wrote VIDEOBITSTREAM_MAX_BRIGHTNESS are taken to use them all.
+
+#ifndef VIDEOBITSTREAM_MAX_BRIGHTNESS
+	#define VIDEOBITSTREAM_MAX_BRIGHTNESS (DUTY_CYCLE_SIZE-1)
+#endif
+
+#if SCALED_DUTY( DUTY_CURVE(VIDEOBITSTREAM_MAX_BRIGHTNESS) ) > 255
+
+#define WIDE_DUTY_CYCLES
+
+#if defined(INTERPOLATE) || defined(DISPLAY_LIST)
+	#error "With duty cycles past 255 each pixel takes a word, and INTERPOLATE or DISPLAY_LIST would need more than the 256 bytes of RAM. Turn down FULL_ON_DUTYCYCLE."
+#endif
+
+typedef word dutycycle;
+
+#define DUTY_CYCLE(b) SCALED_DUTY( DUTY_CURVE(b) )
+
+#else
+
+// Same 8 bit code as always, just a different curve. Levels the clip never uses get clamped to fit.
+
+typedef byte dutycycle;
+
+#define DUTY_CYCLE(b) ( SCALED_DUTY( DUTY_CURVE(b) ) > 255 ? 255 : SCALED_DUTY( DUTY_CURVE(b) ) )
+
+#endif
+
+#define BRIGHTEST_DUTYCYCLE DUTY_CYCLE(DUTY_CYCLE_SIZE-1)
+
+#define DUTY_CYCLE_TABLE \
+	DUTY_CYCLE(0),  DUTY_CYCLE(1),  DUTY_CYCLE(2),  DUTY_CYCLE(3),  DUTY_CYCLE(4),  DUTY_CYCLE(5),  DUTY_CYCLE(6),  DUTY_CYCLE(7), \
+	DUTY_CYCLE(8),  DUTY_CYCLE(9),  DUTY_CYCLE(10), DUTY_CYCLE(11), DUTY_CYCLE(12), DUTY_CYCLE(13), DUTY_CYCLE(14), DUTY_CYCLE(15), \
+	DUTY_CYCLE(16), DUTY_CYCLE(17), DUTY_CYCLE(18), DUTY_CYCLE(19), DUTY_CYCLE(20), DUTY_CYCLE(21), DUTY_CYCLE(22), DUTY_CYCLE(23), \
+	DUTY_CYCLE(24), DUTY_CYCLE(25), DUTY_CYCLE(26), DUTY_CYCLE(27), DUTY_CYCLE(28), DUTY_CYCLE(29), DUTY_CYCLE(30), DUTY_CYCLE(31)
+
+#ifdef WIDE_DUTY_CYCLES
+
+// Twice the size now, so this one goes in flash
+
+static word const PROGMEM brightness2Dutycycle[DUTY_CYCLE_SIZE] = { DUTY_CYCLE_TABLE };
+
+#else
+
+static byte const PROGMEM brightness2Dutycycle[DUTY_CYCLE_SIZE] = { DUTY_CYCLE_TABLE };
+
+#endif
+
+#endif
+
+#ifdef DITHER
+
+#if FULL_ON_DUTYCYCLE != 255 || defined(INTERPOLATE) || defined(CONCURRENT_ROWS) || defined(BAM) || defined(DISPLAY_LIST)
+	#error "DITHER only works with the plain refresh loop and FULL_ON_DUTYCYCLE 255, since everything else would take the dither codes in fda[] for cycle counts"
+#endif
+
+#if F_CPU != 8000000UL
+	#error "DITHER's codes and cycle counts would overlap once the cycle counts were scaled down, so it needs an 8Mhz F_CPU"
+#endif
+
+#ifndef VIDEOBITSTREAM_DITHER
+	#error "DITHER changes what the dim brightness levels mean, so the video has to be encoded for it. Re-run the encoder with -D."
+#endif
+
+#elif defined(VIDEOBITSTREAM_DITHER)
+	#error "VideoBitStream.c was encoded with -D for DITHER. Turn on DITHER in candle.h or re-encode without -D."
+#endif
+
+#ifdef WIDE_DUTY_CYCLES
+	#define pgm_read_dutycycle_near(p) pgm_read_word_near(p)
+#else
+	#define pgm_read_dutycycle_near(p) pgm_read_byte_near(p)
+#endif
+
+#define getDutyCycle(b) ( pgm_read_dutycycle_near( &brightness2Dutycycle[b] ) )
 
 #define FDA_X_MAX ( (byte) 5 )
 #define FDA_Y_MAX ( (byte) 8 )
@@ -81,9 +236,36 @@ const byte brightness2Dutycycle[DUTY_CYCLE_SIZE] = {
 // Now fda is linear - with x then y for easy scanning in x direction
 // Graph paper style - x goes left to right, y goes bottom to top 
 
-byte fda[FDA_SIZE];
+#ifdef DOUBLE_BUFFER
+
+// nextFrame() decodes into fdaBack[] while refreshScreenClean() keeps showing fda[], and they trade places once the whole frame is in.
+// Pointers so the trade is just swapping them, rather than copying the whole frame during a refresh.
+
+dutycycle fdaBuffers[2][FDA_SIZE];
+dutycycle *fda = fdaBuffers[0];
+dutycycle *fdaBack = fdaBuffers[1];
+
+#else
+
+dutycycle fda[FDA_SIZE];
+#define fdaBack fda
+
+#endif
+
+#if (BITSTREAM_FORMAT == BITSTREAM_DELTA) || (BITSTREAM_FORMAT == BITSTREAM_SPATIAL)
+#define KEEP_BRIGHTNESS
+byte fdaBrightness[FDA_SIZE];		// The 5 bit brightness behind each duty cycle in fda[], since deltas are in brightness steps not duty cycles
+#endif
+
+#if !defined(TIMER1_WAKE) && REFRESH_RATE != 62
+	#error "Without TIMER1_WAKE we refresh once per 16ms watchdog wake, so REFRESH_RATE has to be 62"
+#endif
 
-#define REFRESH_RATE ( (byte) 62 )			// Display Refresh rate in Hz (picked to match the fastest we can get WDT wakeups)
+#if FRAME_RATE > REFRESH_RATE || REFRESH_RATE + FRAME_RATE > 255
+	#error "FRAME_RATE can't be faster than REFRESH_RATE, and they have to add up to less than 256 to fit in frameClock"
+#endif
+
+#define REFRESH_PER_FRAME ( REFRESH_RATE / FRAME_RATE )		// Fewest refreshes between frames. Sometimes there is one more, see frameClock.
 
 #ifdef DEBUG
 #define TIMECHECK 1				// Twittle bits so we can watch timing on an osciliscope
@@ -95,18 +277,638 @@ byte fda[FDA_SIZE];
 
 byte diagPos=0;		// current screen pixel when scanning in diagnostic modes 0=starting to turn on, FDA_SIZE=starting to turn off, FDA_SIZE*2=done with diagnostics
 
+// Bitstream reader state. These live across frames (and WDT resets) since frames are packed back to back with no byte alignment
+
+static byte const *candleBitstremPtr;     // next byte to read from the bitstream in program memory
+static byte workingByte;			  // current working byte
+static byte workingBitsLeft;      // how many bits left in the current working byte? 0 triggers loading next byte
+
+// Get the next bit from the bitstream, LSB of each byte first
+static inline byte readBit(void) {
+	if (workingBitsLeft==0) {										// normalize to next byte if we are out of bits
+		workingByte=pgm_read_byte_near(candleBitstremPtr++);
+		workingBitsLeft=8;
+	}
+
+	byte workingBit = (workingByte & 0x01);
+
+	workingByte >>=1;
+	workingBitsLeft--;
+
+	return workingBit;
+}
+
+// Get the next (count) bits from the bitstream as a number, MSB first
+static inline word readBits( byte count ) {
+	word value = 0;
+
+	while (count--) {
+		value <<= 1;
+		value |= readBit();
+	}
+
+	return value;
+}
+
+// Point the reader at bit (offset) of the bitstream, so we can jump around in it without decoding everything before
+static inline void seekBit( word offset ) {
+	candleBitstremPtr = videobitstream + (offset>>3);
+	workingByte = pgm_read_byte_near(candleBitstremPtr++) >> (offset & 0x07);
+	workingBitsLeft = 8 - (offset & 0x07);
+}
+
+#ifdef VIDEOBITSTREAM_FRAME_REFERENCES
+
+// A frame reference replays a run of earlier frames by pointing the reader back at them. This is where to carry on afterwards.
+// Only 5 bytes of RAM, no history buffer needed since the frames are just decoded again from flash.
+
+static byte replayFramesLeft;						// How many more frames to replay before jumping back
+static byte const *returnBitstremPtr;				// NULL when not replaying
+static byte returnWorkingByte;
+static byte returnWorkingBitsLeft;
+
+#endif
+
+#ifdef VIDEOBITSTREAM_HOLDS
+
+static byte holdFramesLeft;			// How many more frames to just leave the display alone for
+
+#endif
+
+#ifdef VIDEOBITSTREAM_SEGMENTS
+
+// Instead of looping, play a segment and then jump to one of the segments allowed to follow it, picked with a 16 bit LFSR.
+// Each segment starts with a keyframe so it does not matter what was on the display before.
+
+#define SEGMENT_RECORD_SIZE 5		// videosegments[] is bit offset (2 bytes), frame count, first successor, successor count. Must match the encoder.
+
+static byte segment = VIDEOBITSTREAM_SEGMENT_COUNT;		// Which segment is playing? Starts past the end so we begin with segment 0
+static byte segmentFramesLeft;
+static word segmentLfsr = 0xace1;							// Any non-zero seed, only set on power up
+
+// Galois LFSR, taps 16,14,13,11 for the full 65535 period
+static inline void stepSegmentLfsr(void) {
+	if (segmentLfsr & 1) {
+		segmentLfsr = (segmentLfsr >> 1) ^ 0xb400;
+	} else {
+		segmentLfsr >>= 1;
+	}
+}
+
+#endif
+
+#ifdef EEPROM_RESUME
+
+// Every RESUME_SAVE_SECONDS we save the keyframe (or segment) we just started to EEPROM. On power up we start one further on from it.
+
+#if !defined(VIDEOBITSTREAM_KEYFRAMES) && !defined(VIDEOBITSTREAM_SEGMENTS)
+	#error "EEPROM_RESUME needs keyframes or segments to start from. Re-run the encoder with -k or -g."
+#endif
+
+#define RESUME_SAVE_FRAMES ((word) RESUME_SAVE_SECONDS * FRAME_RATE)
+
+static word framesSinceSave;
+
+#ifdef VIDEOBITSTREAM_SEGMENTS
+
+static byte EEMEM savedSegment;
+static word EEMEM savedLfsr;
+
+#else
+
+static byte EEMEM savedKeyframe;
+static byte resumeKeyframe;					// Where the first loop after power up starts, 0 once we have started there
+
+#endif
+
+// Only called once on power up, before the watchdog is running, so we have time to wait for EEPROM writes here
+static inline void loadResumePoint(void) {
+
+#ifdef VIDEOBITSTREAM_SEGMENTS
+
+	segment = eeprom_read_byte( &savedSegment );		// We go on to one of its successors. Blank EEPROM is past the end, so segment 0.
+	if (segment > VIDEOBITSTREAM_SEGMENT_COUNT) segment = VIDEOBITSTREAM_SEGMENT_COUNT;
+
+	word lfsr = eeprom_read_word( &savedLfsr );
+	if (lfsr) segmentLfsr = lfsr;
+	stepSegmentLfsr();									// So the next power up picks differently even if we never get to save
+	eeprom_write_word( &savedLfsr , segmentLfsr );
+
+#else
+
+	byte k = eeprom_read_byte( &savedKeyframe ) + 1;	// Blank EEPROM is 0xff, so that comes out as 0 too
+	if (k >= VIDEOBITSTREAM_KEYFRAME_COUNT) k = 0;
+	resumeKeyframe = k;
+	eeprom_write_byte( &savedKeyframe , k );			// So a quick power cycle still moves on
+
+#endif
+
+}
+
+#endif
+
+#define RLE_RUN_K 1		// Order of the Exp-Golomb code for run lengths. Must match RLE_RUN_K in the encoder.
+
+#ifdef TABLE_DECODE
+
+// How many 0 (unchanged pixel) bits are at the bottom of a nibble of workingByte, so we can skip them all in one step
+
+static byte const PROGMEM skipBitsTable[16] = { 4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0 };
+
+// brightness2Dutycycle[] indexed by the 5 brightness bits exactly as they sit in workingByte (LSB first, so reversed).
+// Lets us grab a whole brightness field with a mask instead of reassembling it a bit at a time.
+
+#if FULL_ON_DUTYCYCLE == 255 && defined(DITHER)
+
+static byte const PROGMEM rawBits2Dutycycle[DUTY_CYCLE_SIZE] = {
+	0,    17,     8,    72,     4,    35,    12,   148,     2,
+	24,   10,   103,     6,    50,    14,   213,     1,    20,
+	9,    86,     5,    42,    13,   177,     3,    29,    11,
+	124,   7,    60,    15,   255,
+};
+
+#elif FULL_ON_DUTYCYCLE == 255
+
+static byte const PROGMEM rawBits2Dutycycle[DUTY_CYCLE_SIZE] = {
+	SCALED_DUTY(0), SCALED_DUTY(51), SCALED_DUTY(12), SCALED_DUTY(134),
+	SCALED_DUTY(4), SCALED_DUTY(86), SCALED_DUTY(27), SCALED_DUTY(197),
+	SCALED_DUTY(2), SCALED_DUTY(67), SCALED_DUTY(18), SCALED_DUTY(163),
+	SCALED_DUTY(7), SCALED_DUTY(108), SCALED_DUTY(38), SCALED_DUTY(235),
+	SCALED_DUTY(1), SCALED_DUTY(58), SCALED_DUTY(15), SCALED_DUTY(148),
+	SCALED_DUTY(5), SCALED_DUTY(96), SCALED_DUTY(32), SCALED_DUTY(216),
+	SCALED_DUTY(3), SCALED_DUTY(76), SCALED_DUTY(22), SCALED_DUTY(180),
+	SCALED_DUTY(9), SCALED_DUTY(120), SCALED_DUTY(44), SCALED_DUTY(255),
+};
+
+#else
+
+static dutycycle const PROGMEM rawBits2Dutycycle[DUTY_CYCLE_SIZE] = {
+	DUTY_CYCLE(0),  DUTY_CYCLE(16), DUTY_CYCLE(8),  DUTY_CYCLE(24), DUTY_CYCLE(4),  DUTY_CYCLE(20), DUTY_CYCLE(12), DUTY_CYCLE(28),
+	DUTY_CYCLE(2),  DUTY_CYCLE(18), DUTY_CYCLE(10), DUTY_CYCLE(26), DUTY_CYCLE(6),  DUTY_CYCLE(22), DUTY_CYCLE(14), DUTY_CYCLE(30),
+	DUTY_CYCLE(1),  DUTY_CYCLE(17), DUTY_CYCLE(9),  DUTY_CYCLE(25), DUTY_CYCLE(5),  DUTY_CYCLE(21), DUTY_CYCLE(13), DUTY_CYCLE(29),
+	DUTY_CYCLE(3),  DUTY_CYCLE(19), DUTY_CYCLE(11), DUTY_CYCLE(27), DUTY_CYCLE(7),  DUTY_CYCLE(23), DUTY_CYCLE(15), DUTY_CYCLE(31),
+};
+
+#endif
+
+#endif
+
+#ifdef INTERPOLATE
+
+#ifndef DOUBLE_BUFFER
+	#error "INTERPOLATE needs DOUBLE_BUFFER, since the decoder keeps its frame in fdaBack[] while fda[] slides towards it"
+#endif
+
+// How much to add to each pixel in fda[] on each refresh to get to the new frame. 2's complement, we only ever add it.
+
+dutycycle fdaStep[FDA_SIZE];
+byte interpolateStepsLeft;
+
+#endif
+
+#ifdef GOVERNOR
+
+#ifdef DITHER
+	#error "GOVERNOR would scale DITHER's codes along with the cycle counts"
+#endif
+
+// Tiers the governor steps down through as the battery runs down. New pixels get scaled as they are decoded, and whatever is
+// already in the frame buffers gets scaled in place when the tier changes. Halving rounds up, so a lit pixel never goes dark.
+//
+// 0 - Full
+// 1 - 1/2
+// 2 - 1/4
+// 3 - 1/4, and only every other refresh lit
+//
+// There is only the one comparator threshold, so the tiers are not battery levels, just how long the supply has been below
+// it. That is why they only ever go down. A cell that dips under the threshold at full load reads high again as soon as
+// the lighter load of a dimmer tier lets it recover, and stepping back up on that just pulls it down again, so the candle
+// would flick between tiers for as long as the battery lasts. Only a real power up (like a fresh battery) starts back at full.
+
+#define GOVERNOR_TIERS			4
+#define GOVERNOR_SKIP_TIER		3
+
+#define GOVERNOR_SAMPLE_REFRESHES ((word) GOVERNOR_SAMPLE_SECONDS * REFRESH_RATE)
+
+// warmstart() skips the .data and .bss init, so all these carry over from one wake to the next
+
+static byte governorTier;
+static byte governorShift;			// How many times each duty cycle gets halved at this tier
+static byte governorLowRun;			// Low samples in a row
+static word governorCountdown;		// Refreshes until the next sample
+static byte governorDark;			// Set on the refreshes a skip tier leaves dark
+
+static inline dutycycle governDutyCycle( dutycycle d ) {
+	for( byte s = governorShift ; s ; s-- ) {
+		d = d - (d>>1);
+	}
+	return d;
+}
+
+#define governedDutyCycle(d) governDutyCycle(d)
+
+// Move down a tier, and halve everything already in the frame buffers to match. With INTERPOLATE the rest of the slide to
+// the current frame is dropped, since its steps were worked out at the old scale. fda[] just holds where it got to until
+// the next frame starts a new slide a few refreshes later.
+
+static void governorStepDown(void) {
+	governorTier++;
+
+	if (governorTier >= GOVERNOR_SKIP_TIER) return;		// Same scale, just dark every other refresh
+
+	governorShift = governorTier;
+
+#ifdef DOUBLE_BUFFER
+	dutycycle *p = fdaBuffers[0];
+	dutycycle *end = fdaBuffers[0] + (FDA_SIZE*2);
+#else
+	dutycycle *p = fda;
+	dutycycle *end = fda + FDA_SIZE;
+#endif
+
+	while (p < end) {
+		dutycycle d = *p;
+		*p = d - (d>>1);
+		p++;
+	}
+
+#ifdef INTERPOLATE
+	interpolateStepsLeft = 0;
+#endif
+}
+
+// Count one sample towards stepping down a tier. Kept apart from the comparator so a simulation can feed it whatever
+// readings it likes and check where the tiers land.
+
+static void governorUpdate( byte supplyLow ) {
+	if (!supplyLow) {
+		governorLowRun = 0;
+		return;
+	}
+
+	if ( ++governorLowRun >= GOVERNOR_SAMPLES_DOWN ) {
+		governorLowRun = 0;
+		if ( governorTier < GOVERNOR_TIERS-1 ) governorStepDown();
+	}
+}
+
+#else
+
+#define governedDutyCycle(d) (d)
+
+#endif
+
+#ifdef BAM
+static void bamSlice(void);
+#endif
+
+#ifdef DISPLAY_LIST
+static void buildDisplayList(void);
+#endif
+
+// Put the frame that was just decoded up on the screen
+
+static inline void showFrame(void) {
+#if defined(INTERPOLATE)
+
+	// Rather than jumping straight to the new frame, fda[] gets there in REFRESH_PER_FRAME equal steps. The first step goes in
+	// right away along with whatever doesn't divide evenly, so we land exactly on it without having to keep the remainders
+	// around, and the new frame is all the way up by the last refresh before the next one even when frames are only
+	// REFRESH_PER_FRAME refreshes apart.
+	// REFRESH_PER_FRAME is 4 at 15fps, so the divide is just shifts. Other frame rates will pull in a divide routine.
+	// fdaBack[] is left alone since the decoder needs it for the next frame.
+
+	for( byte i = 0 ; i < FDA_SIZE ; i++ ) {
+		dutycycle target = fdaBack[i];
+		dutycycle step = ( (int) target - (int) fda[i] ) / REFRESH_PER_FRAME;
+
+		fdaStep[i] = step;
+		fda[i] = target - (dutycycle) (step * (REFRESH_PER_FRAME-1));
+	}
+
+	interpolateStepsLeft = REFRESH_PER_FRAME-1;
+
+#elif defined(DOUBLE_BUFFER)
+	dutycycle *t = fda;
+	fda = fdaBack;
+	fdaBack = t;
+
+	memcpy( fdaBack , fda , sizeof( fdaBuffers[0] ) );		// Next frame only codes the pixels that change, so it has to start from this one
+#endif
+
+#ifdef BAM
+	bamSlice();
+#endif
+
+#ifdef DISPLAY_LIST
+	buildDisplayList();
+#endif
+}
+
+// Where the decoder is in the frame. These live across wakes so that a frame can be decoded a slice at a time (see DECODE_SLICES).
+
+#if (WIDTH*HEIGHT) % DECODE_SLICES
+	#error "DECODE_SLICES has to divide evenly into the number of pixels"
+#endif
+
+static byte fdaIndex;				// Which byte of the FDA are we filling in? Start at end because compare to zero slightly more efficient and and that is how data is encoded
+static byte sliceEnd;				// This slice is done once fdaIndex (pixelsLeft for BITSTREAM_SPATIAL) is down to here
+static byte decodeSlicesLeft;		// Slices of the current frame still to decode
+
+#if BITSTREAM_FORMAT == BITSTREAM_SPATIAL
+
+static byte pixelsLeft;
+static byte lastStep;				// How much the last pixel changed by (2's complement, we only ever add it)
+
+#if VIDEOBITSTREAM_SCAN_ORDER == SCAN_SERPENTINE
+static byte scanStep;				// Up (+FDA_X_MAX) or down (-FDA_X_MAX) the current column
+#endif
+
+#endif
+
+// Decode the next slice of the frame that nextFrame() started. Not inline since it can get called from a few places.
+// Stops at the first pixel boundary at or after the end of the slice, so a slice can come out a little long when a run
+// of unchanged pixels crosses the boundary, and the next one a little short.
+static void decodeSlice(void) {
+
+		  decodeSlicesLeft--;
+		  sliceEnd -= FDA_SIZE / DECODE_SLICES;
+
+#if BITSTREAM_FORMAT == BITSTREAM_RLE
+
+		  // Each token is the count of unchanged pixels to skip, followed by the new brightness of the pixel after them.
+		  // A run that reaches the end of the frame has no brightness after it.
+
+		  while ( fdaIndex > sliceEnd ) {
+			  byte runBits = RLE_RUN_K;			// Exp-Golomb: count the leading zeros, then read that many more bits (plus K) after the 1
+
+			  while (readBit()==0) runBits++;
+
+			  byte run = 1;
+
+			  while (runBits--) {
+				  run <<= 1;
+				  run |= readBit();
+			  }
+
+			  fdaIndex -= run - _BV(RLE_RUN_K);		// Skip the whole run of unchanged pixels at once
+
+			  if (fdaIndex > 0) {
+				  byte workingBrightness = 0;
+
+				  for( byte b = BRIGHTNESSBITS ; b>0 ; b-- ) {
+					  workingBrightness <<=1;
+					  workingBrightness |= readBit();
+				  }
+
+				  fdaBack[--fdaIndex] = governedDutyCycle( getDutyCycle(workingBrightness) );
+			  }
+
+		  }
+
+#elif BITSTREAM_FORMAT == BITSTREAM_HUFFMAN
+
+		  // 0 bit is an unchanged pixel, 1 bit is followed by a canonical Huffman code for the new brightness.
+		  // Canonical codes of each length are consecutive numbers, so we only need to know how many codes there are of each length
+		  // to tell when we have read a whole one. The encoder keeps codes to 8 bits or less so everything fits in a byte.
+
+		  while ( fdaIndex > sliceEnd ) {
+			  if (readBit()) {
+				  byte code = 0;						// Code read so far
+				  byte first = 0;						// First code of the current length
+				  byte index = 0;						// Index in huffmanSymbols[] of the first code of the current length
+				  byte const *countPtr = huffmanCodeCounts;
+
+				  for(;;) {
+					  code |= readBit();
+
+					  byte count = pgm_read_byte_near(countPtr++);
+
+					  if ( (byte) (code-first) < count ) break;		// Got a whole code
+
+					  index += count;
+					  first += count;
+					  first <<= 1;
+					  code <<= 1;
+				  }
+
+				  fdaBack[--fdaIndex] = governedDutyCycle( getDutyCycle( pgm_read_byte_near( &huffmanSymbols[ index + (byte) (code-first) ] ) ) );
+
+			  } else {
+				  --fdaIndex;
+			  }
+		  }
+
+#elif BITSTREAM_FORMAT == BITSTREAM_DELTA
+
+		  // 0 bit is an unchanged pixel. 1 bit is followed by either a small step up or down from the old brightness, or a whole new brightness.
+		  //	1 0 s			+/- 1
+		  //	1 1 0 m s		+/- 2+m
+		  //	1 1 1 bbbbb		bbbbb
+
+		  while ( fdaIndex > sliceEnd ) {
+			  --fdaIndex;
+
+			  if (readBit()) {
+				  byte workingBrightness = fdaBrightness[fdaIndex];
+				  byte step = 1;
+
+				  if (readBit()) {
+					  if (readBit()) {										// Escape to an absolute brightness
+						  workingBrightness = 0;
+						  step = 0;
+
+						  for( byte b = BRIGHTNESSBITS ; b>0 ; b-- ) {
+							  workingBrightness <<=1;
+							  workingBrightness |= readBit();
+						  }
+					  } else {
+						  step = 2 + readBit();
+					  }
+				  }
+
+				  if (step) {
+					  if (readBit()) {
+						  workingBrightness -= step;
+					  } else {
+						  workingBrightness += step;
+					  }
+				  }
+
+				  fdaBrightness[fdaIndex] = workingBrightness;
+				  fdaBack[fdaIndex] = governedDutyCycle( getDutyCycle(workingBrightness) );
+			  }
+		  }
+
+#elif BITSTREAM_FORMAT == BITSTREAM_SPATIAL
+
+		  // 0 bit is an unchanged pixel. 1 bit means it changed, and we predict it changed by the same step as the pixel before it in the scan
+		  //	1 0 s			prediction +/- 1
+		  //	1 1 0			prediction
+		  //	1 1 1 0 m s		prediction +/- 2+m
+		  //	1 1 1 1 bbbbb	bbbbb
+
+		  while ( pixelsLeft > sliceEnd ) {
+			  if (readBit()) {
+				  byte oldBrightness = fdaBrightness[fdaIndex];
+				  byte workingBrightness = oldBrightness + lastStep;
+
+				  if (readBit()==0) {
+					  if (readBit()) {
+						  workingBrightness--;
+					  } else {
+						  workingBrightness++;
+					  }
+				  } else if (readBit()) {
+					  if (readBit()) {									// Escape to an absolute brightness
+						  workingBrightness = 0;
+
+						  for( byte b = BRIGHTNESSBITS ; b>0 ; b-- ) {
+							  workingBrightness <<=1;
+							  workingBrightness |= readBit();
+						  }
+					  } else {
+						  byte step = 2 + readBit();
+
+						  if (readBit()) {
+							  workingBrightness -= step;
+						  } else {
+							  workingBrightness += step;
+						  }
+					  }
+				  }
+
+				  lastStep = workingBrightness - oldBrightness;
+				  fdaBrightness[fdaIndex] = workingBrightness;
+				  fdaBack[fdaIndex] = governedDutyCycle( getDutyCycle(workingBrightness) );
+			  } else {
+				  lastStep = 0;
+			  }
+
+			  // Step to the next pixel in the scan
+
+	#if VIDEOBITSTREAM_SCAN_ORDER == SCAN_ROWS
+			  fdaIndex--;
+	#elif VIDEOBITSTREAM_SCAN_ORDER == SCAN_COLUMNS
+			  fdaIndex += FDA_X_MAX;
+			  if (fdaIndex >= FDA_SIZE) fdaIndex -= FDA_SIZE-1;		// Off the top, so back to the bottom of the next column
+	#else
+			  fdaIndex += scanStep;
+			  if (fdaIndex >= FDA_SIZE) {								// Off the top or (wrapping around) the bottom, so move over a column and turn around
+				  fdaIndex -= scanStep;
+				  fdaIndex++;
+				  scanStep = -scanStep;
+			  }
+	#endif
+
+			  pixelsLeft--;
+		  }
+
+#elif defined(TABLE_DECODE)		// BITSTREAM_CLASSIC, a run of bits at a time
+
+		  while ( fdaIndex > sliceEnd ) {
+			  if (workingBitsLeft==0) {										// normalize to next byte if we are out of bits
+				  workingByte=pgm_read_byte_near(candleBitstremPtr++);
+				  workingBitsLeft=8;
+			  }
+
+			  if ( workingByte & 0x01 ) {		// 1 bit means a brightness value follows
+
+				  workingByte >>=1;
+				  workingBitsLeft--;
+
+				  byte rawBits;
+
+				  if (workingBitsLeft >= BRIGHTNESSBITS) {		// Whole brightness field is already in the working byte
+					  rawBits = workingByte;
+					  workingByte >>= BRIGHTNESSBITS;
+					  workingBitsLeft -= BRIGHTNESSBITS;
+				  } else {										// Field straddles into the next byte, so splice the two together
+					  byte nextByte = pgm_read_byte_near(candleBitstremPtr++);
+					  rawBits = workingByte | (nextByte << workingBitsLeft);
+					  workingByte = nextByte >> (BRIGHTNESSBITS-workingBitsLeft);
+					  workingBitsLeft += 8-BRIGHTNESSBITS;
+				  }
+
+				  fdaBack[--fdaIndex] = governedDutyCycle( pgm_read_dutycycle_near( &rawBits2Dutycycle[ rawBits & (DUTY_CYCLE_SIZE-1) ] ) );
+
+			  } else {							// Skip as many unchanged pixels as we can see at once
+
+				  byte skip;
+
+				  if (workingByte==0) {								// All the bits left in this byte are skips (bits above workingBitsLeft have been shifted out to 0)
+					  skip = workingBitsLeft;
+				  } else {
+					  skip = pgm_read_byte_near( &skipBitsTable[ workingByte & 0x0f ] );		// Byte is not 0, so the 1 bit that ends this run is inside workingBitsLeft
+				  }
+
+				  if (skip > fdaIndex) skip = fdaIndex;				// Don't run into the next frame
+
+				  fdaIndex -= skip;
+				  workingByte >>= skip;
+				  workingBitsLeft -= skip;
+			  }
+
+		  }
+
+#else	// BITSTREAM_CLASSIC, a bit at a time
+
+		  byte brightnessBitsLeft=0;	// Currently building a brightness value? How many bits left to read in?
+		  byte workingBrightness;		// currently building brightness value
+		  
+		  while ( fdaIndex > sliceEnd ) {			// step though each pixel in the fda
+			  if (workingBitsLeft==0) {										// normalize to next byte if we are out of bits
+				  workingByte=pgm_read_byte_near(candleBitstremPtr++);
+				  workingBitsLeft=8;
+			  }
+			  
+			  byte workingBit = (workingByte & 0x01);
+			  
+			  if (brightnessBitsLeft>0) { //are we currently reading brightness? Consume as many bits as we can (if too few) or as we need (if too manY) from working byte into brightness
+				  workingBrightness <<=1;
+				  workingBrightness |= workingBit;
+
+				  brightnessBitsLeft--;
+
+				  if (brightnessBitsLeft==0) {		// We've gotten enough bits to assign the next pixel!
+					  fdaBack[--fdaIndex] = governedDutyCycle( getDutyCycle(workingBrightness) );
+				  }
+					  				  
+			  } else { // We are not currently reading in a pending brightness value 
+				  if ( workingBit ==  0x00 ) {		// 0 bit indicates that this pixel has not changed
+					  --fdaIndex;								// So skip it
+				  } else {							// Start reading in the following bits as a brightness value
+					  brightnessBitsLeft = BRIGHTNESSBITS;					// Now we will read in the brightness value on next loops though
+					  workingBrightness = 0;
+				  }
+			  }
+			  
+			  workingByte >>=1;
+			  workingBitsLeft--;
+
+		  }
+
+#endif
+
+		  if (!decodeSlicesLeft) showFrame();
+}
+
 // Decode next frame into the FDA
 static inline void nextFrame(void) {
 	
 	  #ifdef TIMECHECK
 		  PORTA |= _BV(1);
 	  #endif
+
+#if DECODE_SLICES > 1
+	  while (decodeSlicesLeft) decodeSlice();		// Finish off the last frame if there were more slices than wakes to do them in
+#endif
 	  
 	  if (0) {
   				byte fdaptr = 0;
 		  
 				for(byte b=0;b<(_BV(BRIGHTNESSBITS));b++){
-					byte d = getDutyCycle( b);				// normalize step variable to always cycle within brightness range
+					dutycycle d = getDutyCycle( b);				// normalize step variable to always cycle within brightness range
 					fda[fdaptr++] = d;
 				}
 				
@@ -122,14 +924,14 @@ static inline void nextFrame(void) {
 #endif
 		  
 		  if (diagPos<FDA_SIZE) {						// Fill screen in with pixels
-			  fda[diagPos] = FULL_ON_DUTYCYCLE;
+			  fdaBack[diagPos] = BRIGHTEST_DUTYCYCLE;
 
 #ifdef DEBUG
 		  } else if (diagPos<FDA_SIZE*2) {				// Empty out
 #else
 		  } else {
 #endif
-			  fda[(diagPos)-FDA_SIZE] = 0;
+			  fdaBack[(diagPos)-FDA_SIZE] = 0;
 
 #ifdef DEBUG
 		  } else /* if (diagPos>=FDA_SIZE*2) && (diagPos<FDA_SIZE*4) */ {										// Brightness test pattern
@@ -137,10 +939,10 @@ static inline void nextFrame(void) {
 				byte fdaptr = 0;
 			
 				for(byte y=0; y<FDA_Y_MAX;y++) {
-					byte b = getDutyCycle( step & (_BV(BRIGHTNESSBITS)-1) );				// normalize step variable to always cycle within brightness range
+					dutycycle b = getDutyCycle( step & (_BV(BRIGHTNESSBITS)-1) );				// normalize step variable to always cycle within brightness range
 				
 					for(byte x=0;x<FDA_X_MAX;x++) {
-						fda[fdaptr++] = b;
+						fdaBack[fdaptr++] = b;
 					}
 
 					step++;
@@ -149,60 +951,168 @@ static inline void nextFrame(void) {
 		  }
 			  
 		  diagPos++;
+		  showFrame();
 		  
 	   } else {  // normal video playback....
 		  // Time to display the next frame in the animation...
-		  // copy the next frame from program memory (candel_bitstream[]) to the RAM frame buffer (fda[])
-		  		  
-		  static byte const *candleBitstremPtr;     // next byte to read from the bitstream in program memory
-		  static byte workingByte;			  // current working byte
-		  static byte workingBitsLeft;      // how many bits left in the current working byte? 0 triggers loading next byte
+		  // copy the next frame from program memory (candel_bitstream[]) to the RAM frame buffer (fdaBack[])
+
+#ifdef VIDEOBITSTREAM_SEGMENTS
+
+		  if ( !segmentFramesLeft ) {				// End of this segment, so pick the next one
+
+			  if ( segment==VIDEOBITSTREAM_SEGMENT_COUNT ) {
+				  segment = 0;
+			  } else {
+				  byte const *current = videosegments + (segment * SEGMENT_RECORD_SIZE);
+
+				  stepSegmentLfsr();
+
+				  segment = pgm_read_byte_near( videosegmentnext + pgm_read_byte_near(current+3) + ((byte) segmentLfsr % pgm_read_byte_near(current+4)) );
+			  }
+
+			  byte const *record = videosegments + (segment * SEGMENT_RECORD_SIZE);
+
+			  seekBit( pgm_read_word_near(record) );
+			  segmentFramesLeft = pgm_read_byte_near(record+2);
+
+#ifdef VIDEOBITSTREAM_FRAME_REFERENCES
+			  replayFramesLeft = 0;					// The encoder never lets these run past the end of a segment, but a replay can end right on it
+			  returnBitstremPtr = 0;
+#endif
+
+#ifdef EEPROM_RESUME
+			  if (framesSinceSave >= RESUME_SAVE_FRAMES) {
+				  eeprom_write_byte( &savedSegment , segment );		// Finishes by itself while we sleep
+				  framesSinceSave = 0;
+			  }
+#endif
+		  }
+
+		  segmentFramesLeft--;
+
+#else
+
 		  static framecounttype frameCount = FRAMECOUNT;		// what frame are we on?
 
 		  if ( frameCount==FRAMECOUNT ) {							// Is this the last frame?
-			  memset( fda , 0x00 , FDA_SIZE );			// zero out the display buffer, becuase that is how the encoder currently works
+			  memset( fdaBack , 0x00 , FDA_SIZE * sizeof( dutycycle ) );			// zero out the display buffer, becuase that is how the encoder currently works
+#ifdef KEEP_BRIGHTNESS
+			  memset( fdaBrightness , 0x00 , FDA_SIZE );
+#endif
 			  candleBitstremPtr=videobitstream;		// next byte to read from the bitstream in program memory
 			  workingBitsLeft=0;							// how many bits left in the current working byte? 0 triggers loading next byte
 			  frameCount= 0;
+#ifdef VIDEOBITSTREAM_FRAME_REFERENCES
+			  replayFramesLeft = 0;
+			  returnBitstremPtr = 0;
+#endif
+#ifdef VIDEOBITSTREAM_HOLDS
+			  holdFramesLeft = 0;
+#endif
+
+#ifdef EEPROM_RESUME
+			  if (resumeKeyframe) {					// First time round after power up, so jump straight to the keyframe we are resuming from
+				  seekBit( pgm_read_word_near( videokeyframes + (resumeKeyframe * 2) ) );
+				  frameCount = resumeKeyframe * VIDEOBITSTREAM_KEYFRAME_INTERVAL;
+				  resumeKeyframe = 0;
+			  }
+#endif
 		  }
+
+#ifdef EEPROM_RESUME
+		  if ( framesSinceSave >= RESUME_SAVE_FRAMES && (frameCount % VIDEOBITSTREAM_KEYFRAME_INTERVAL)==0 ) {
+			  eeprom_write_byte( &savedKeyframe , frameCount / VIDEOBITSTREAM_KEYFRAME_INTERVAL );	// Finishes by itself while we sleep
+			  framesSinceSave = 0;
+		  }
+#endif
 		  
 		  frameCount++;
-		  
-		  byte fdaIndex = FDA_SIZE;		// Which byte of the FDA are we filling in? Start at end because compare to zero slightly more efficient and and that is how data is encoded
-		  byte brightnessBitsLeft=0;	// Currently building a brightness value? How many bits left to read in?
-		  byte workingBrightness;		// currently building brightness value
-		  
-		  do {			// step though each pixel in the fda
-			  if (workingBitsLeft==0) {										// normalize to next byte if we are out of bits
-				  workingByte=pgm_read_byte_near(candleBitstremPtr++);
-				  workingBitsLeft=8;
-			  }
-			  
-			  byte workingBit = (workingByte & 0x01);
-			  
-			  if (brightnessBitsLeft>0) { //are we currently reading brightness? Consume as many bits as we can (if too few) or as we need (if too manY) from working byte into brightness
-				  workingBrightness <<=1;
-				  workingBrightness |= workingBit;
 
-				  brightnessBitsLeft--;
+#endif
 
-				  if (brightnessBitsLeft==0) {		// We've gotten enough bits to assign the next pixel!
-					  fda[--fdaIndex] = getDutyCycle(workingBrightness);
-				  }
-					  				  
-			  } else { // We are not currently reading in a pending brightness value 
-				  if ( workingBit ==  0x00 ) {		// 0 bit indicates that this pixel has not changed
-					  --fdaIndex;								// So skip it
-				  } else {							// Start reading in the following bits as a brightness value
-					  brightnessBitsLeft = BRIGHTNESSBITS;					// Now we will read in the brightness value on next loops though
-					  workingBrightness = 0;
-				  }
+#ifdef EEPROM_RESUME
+		  framesSinceSave++;
+#endif
+
+#ifdef VIDEOBITSTREAM_HOLDS
+
+		  if (holdFramesLeft) {			// Still holding, so fda[] already has what we want and there is nothing to decode
+			  holdFramesLeft--;
+			  #ifdef TIMECHECK
+				 PORTA  &= ~_BV(1);
+			  #endif
+			  return;
+		  }
+
+#endif
+
+#ifdef VIDEOBITSTREAM_FRAME_REFERENCES
+
+		  if ( returnBitstremPtr && !replayFramesLeft ) {		// Done replaying, so pick up again just after the reference
+			  candleBitstremPtr = returnBitstremPtr;
+			  workingByte = returnWorkingByte;
+			  workingBitsLeft = returnWorkingBitsLeft;
+			  returnBitstremPtr = 0;
+		  }
+
+#endif
+
+#if defined(VIDEOBITSTREAM_FRAME_REFERENCES) || defined(VIDEOBITSTREAM_HOLDS)
+
+		  if (readBit()) {			// 1 header bit is a reference or hold, 0 is a normally coded frame
+
+#if defined(VIDEOBITSTREAM_FRAME_REFERENCES) && defined(VIDEOBITSTREAM_HOLDS)
+			  if (readBit())		// With both on, another bit says which
+#endif
+#ifdef VIDEOBITSTREAM_HOLDS
+			  {
+				  holdFramesLeft = readBits( VIDEOBITSTREAM_HOLD_BITS );		// Leave this frame and that many more as they are
+				  #ifdef TIMECHECK
+					 PORTA  &= ~_BV(1);
+				  #endif
+				  return;
 			  }
-			  
-			  workingByte >>=1;				
-			  workingBitsLeft--;
-			  
-		  } while ( fdaIndex > 0 );
+#endif
+
+#ifdef VIDEOBITSTREAM_FRAME_REFERENCES
+			  word offset = readBits( VIDEOBITSTREAM_REF_OFFSET_BITS );		// Bit offset of the first frame to replay
+			  replayFramesLeft = readBits( VIDEOBITSTREAM_REF_COUNT_BITS );
+
+			  returnBitstremPtr = candleBitstremPtr;
+			  returnWorkingByte = workingByte;
+			  returnWorkingBitsLeft = workingBitsLeft;
+
+			  seekBit( offset );
+
+			  readBit();				// Skip the replayed frame's own header bit, which is always 0
+#endif
+		  }
+
+#endif
+
+#ifdef VIDEOBITSTREAM_FRAME_REFERENCES
+		  if (replayFramesLeft) replayFramesLeft--;
+#endif
+
+		  fdaIndex = FDA_SIZE;
+		  sliceEnd = FDA_SIZE;
+		  decodeSlicesLeft = DECODE_SLICES;
+
+#if BITSTREAM_FORMAT == BITSTREAM_SPATIAL
+		  pixelsLeft = FDA_SIZE;
+		  lastStep = 0;
+	#if VIDEOBITSTREAM_SCAN_ORDER == SCAN_ROWS
+		  fdaIndex = FDA_SIZE-1;
+	#else
+		  fdaIndex = 0;
+		#if VIDEOBITSTREAM_SCAN_ORDER == SCAN_SERPENTINE
+		  scanStep = FDA_X_MAX;
+		#endif
+	#endif
+#endif
+
+		  decodeSlice();
 		  		  
 		  #ifdef TIMECHECK
 			 PORTA  &= ~_BV(1);
@@ -211,21 +1121,52 @@ static inline void nextFrame(void) {
 }
 
 
+// Pin tables, all worked out from BOARD_ROWS and BOARD_COLS in candle.h
+
+#define BOARD_COUNT( n , ... )					1 +
+#define BOARD_ROW_DIRECTION( y , b , high , ... )	( (high) << (y) ) |
+#define BOARD_ROW_PORTB( y , b , high , ... )		b ,
+#define BOARD_ROW_PORTD( y , b , high , ... )		0 ,
+#define BOARD_COL_PORTB( x , b , d , ... )			b ,
+#define BOARD_COL_PORTD( x , b , d , ... )			d ,
+#define BOARD_COL_PORTB_OR( x , b , d , ... )		b |
+#define BOARD_COL_PORTD_OR( x , b , d , ... )		d |
+#define BOARD_COL_NOT_ONE_PORT( x , b , d , ... )	( !(b) == !(d) ) ||
+
+#if ( BOARD_ROWS( BOARD_COUNT ) 0 ) != HEIGHT || ( BOARD_COLS( BOARD_COUNT ) 0 ) != WIDTH
+	#error "BOARD_ROWS and BOARD_COLS in candle.h need one ROW() for each of the HEIGHT rows and one COL() for each of the WIDTH cols"
+#endif
+
+#if BOARD_COLS( BOARD_COL_NOT_ONE_PORT ) 0
+	#error "Each COL() in BOARD_COLS needs a PORTB bit or a PORTD bit, not both"
+#endif
+
 #define ALL_PORTD_ROWS_ZERO 1		// Just a shortcut hard-coded that all PORTD row bits are zero 
 
-static byte const rowDirectionBits = 0b01010101;      // 0=row goes low, 1=Row goes high
+static byte const rowDirectionBits = BOARD_ROWS( BOARD_ROW_DIRECTION ) 0;      // 0=row goes low, 1=Row goes high
+
+// In flash, since a plain const array still gets copied into RAM at startup, and RAM is the thing we are shortest of
 
-static byte const portBRowBits[ROWS]  = {_BV(0),_BV(0),_BV(2),_BV(2),_BV(4),_BV(4),_BV(6),_BV(6) };
-static byte const portDRowBits[ROWS]  = {     0,     0,     0,     0,     0,     0,     0,     0 };
+static byte const PROGMEM portBRowBits[ROWS]  = { BOARD_ROWS( BOARD_ROW_PORTB ) };
+static byte const PROGMEM portDRowBits[ROWS]  = { BOARD_ROWS( BOARD_ROW_PORTD ) };
 	
 // Note that col is always opposite of row so we don't need colDirectionBits
 
-static byte const portBColBits[COLS] = {_BV(7),_BV(5),_BV(3), _BV(1),     0};
-static byte const portDColBits[COLS] = {     0,     0,      0,     0,_BV(6)};
+static byte const PROGMEM portBColBits[COLS] = { BOARD_COLS( BOARD_COL_PORTB ) };
+static byte const PROGMEM portDColBits[COLS] = { BOARD_COLS( BOARD_COL_PORTD ) };
 
-#define REFRESH_PER_FRAME ( REFRESH_RATE / FRAME_RATE )		// How many refreshes before we trigger the next frame to be drawn?
+#define portBRowBit(y) pgm_read_byte_near( &portBRowBits[y] )
+#define portDRowBit(y) pgm_read_byte_near( &portDRowBits[y] )
+#define portBColBit(x) pgm_read_byte_near( &portBColBits[x] )
+#define portDColBit(x) pgm_read_byte_near( &portDColBits[x] )
 
-byte refreshCount = REFRESH_PER_FRAME+1;
+#define ALL_PORTB_COLS ( BOARD_COLS( BOARD_COL_PORTB_OR ) 0 )
+#define ALL_PORTD_COLS ( BOARD_COLS( BOARD_COL_PORTD_OR ) 0 )
+
+// Goes up by FRAME_RATE every refresh, and we show the next frame each time it gets to REFRESH_RATE. Taking off REFRESH_RATE
+// rather than zeroing it keeps the leftover, so we get exactly FRAME_RATE frames for every REFRESH_RATE refreshes.
+
+byte frameClock = 0;
 
 #define LED_DUTY_CYCLE_PORT (DDRB)			// This is the port we use for actually timing the LEDs on time
 											// We use PORTB rather than PORTD because in the current LED layout, setting DDRB=0 will always turn off all LEDs
@@ -367,6 +1308,560 @@ static inline void ledDutyCycle(unsigned char cycles , byte ledonbits )
 	}	// switch (b)
 }
 
+#ifdef WIDE_DUTY_CYCLES
+
+// Same as ledDutyCycle() but for duty cycles past 255. SBIW+BRNE on a word counter is 4 cycles a loop with no NOP needed,
+// so the math is the same: (cycles/4) loops, then make up the remainder after.
+
+static inline void ledDutyCycle16( word cycles , byte ledonbits )
+{
+	if ( cycles < 256 ) {			// Short ones go through the 8 bit version, which also does the ones too short to loop
+		ledDutyCycle( cycles , ledonbits );
+		return;
+	}
+
+	word loopcounter = cycles / 4;
+
+	switch ( cycles & 0x03 ) {
+		case 0:
+			__asm__ __volatile__ (
+				"OUT %[port],%[bits] \n\t"
+				"L_%=:SBIW %[loop],1 \n\t"		// 2 cycles
+				"BRNE L_%= \n\t"				// 1 on false, 2 on true cycles
+				"OUT %[port],__zero_reg__ \n\t"
+				: [loop] "=w" (loopcounter) : [port] "I" (_SFR_IO_ADDR(LED_DUTY_CYCLE_PORT)) , [bits] "r" (ledonbits) , "0" (loopcounter)
+			);
+			break;
+		case 1:
+			__asm__ __volatile__ (
+				"OUT %[port],%[bits] \n\t"
+				"L_%=:SBIW %[loop],1 \n\t"
+				"BRNE L_%= \n\t"
+				"NOP \n\t"						// 1 cycle after loop
+				"OUT %[port],__zero_reg__ \n\t"
+				: [loop] "=w" (loopcounter) : [port] "I" (_SFR_IO_ADDR(LED_DUTY_CYCLE_PORT)) , [bits] "r" (ledonbits) , "0" (loopcounter)
+			);
+			break;
+		case 2:
+			__asm__ __volatile__ (
+				"OUT %[port],%[bits] \n\t"
+				"L_%=:SBIW %[loop],1 \n\t"
+				"BRNE L_%= \n\t"
+				"RJMP .+0 \n\t"				// 2 cycles after loop
+				"OUT %[port],__zero_reg__ \n\t"
+				: [loop] "=w" (loopcounter) : [port] "I" (_SFR_IO_ADDR(LED_DUTY_CYCLE_PORT)) , [bits] "r" (ledonbits) , "0" (loopcounter)
+			);
+			break;
+		case 3:
+			__asm__ __volatile__ (
+				"OUT %[port],%[bits] \n\t"
+				"L_%=:SBIW %[loop],1 \n\t"
+				"BRNE L_%= \n\t"
+				"RJMP .+0 \n\t"				// 3 cycles after loop
+				"NOP \n\t"
+				"OUT %[port],__zero_reg__ \n\t"
+				: [loop] "=w" (loopcounter) : [port] "I" (_SFR_IO_ADDR(LED_DUTY_CYCLE_PORT)) , [bits] "r" (ledonbits) , "0" (loopcounter)
+			);
+			break;
+	}
+}
+
+#define ledOn ledDutyCycle16
+
+#if defined(CONCURRENT_ROWS) || defined(BAM)
+	#error "CONCURRENT_ROWS and BAM time LEDs in bytes, so they can't do duty cycles past 255. Turn down FULL_ON_DUTYCYCLE."
+#endif
+
+#else
+
+#define ledOn ledDutyCycle
+
+#endif
+
+#ifdef CONCURRENT_ROWS
+
+#define CHAIN_GAP 18			// Fewest cycles between one event in ledChain() and the next, so also the shortest duty cycle it can do
+
+// Turn on all the LEDs in (ddrbbits) at once, then step though (count) events. Each event is a new value for PORTB that turns one or more
+// of them off, and a delay. The event goes out exactly CHAIN_GAP+delay cycles after the one before it (or after they all came on).
+//
+// Per event...
+//		LD,LD										4 cycles
+//		SBRC,RJMP		2 cycles, 3 if delay bit 0	2
+//		SBRC,LPM		2 cycles, 4 if delay bit 1	2
+//		LSR,LSR,INC									3
+//		loop			4*(delay>>2)+3				3
+//		OUT											1
+//		DEC,BRNE (taken)							3	...the first event gets the RJMP,NOP up front instead
+//													=== 
+//													18+delay
+
+static inline void ledChain( byte ddrbbits , byte const *events , byte count )
+{
+	byte value;
+	byte delay;
+
+	__asm__ __volatile__ (
+		"OUT %[ddr],%[on] \n\t"				// Everything comes on together
+		"RJMP .+0 \n\t"						// 3 cycles to stand in for the DEC,BRNE the other events have in front of them
+		"NOP \n\t"
+		"L_next%=:LD %[value],Z+ \n\t"
+		"LD %[delay],Z+ \n\t"
+		"SBRC %[delay],0 \n\t"				// Skipping the RJMP takes as long as not skipping it, so this only adds bit 0
+		"RJMP .+0 \n\t"
+		"SBRC %[delay],1 \n\t"				// Likewise, LPM is 3 cycles so this adds 2 for bit 1. LPM just reads junk into r0.
+		"LPM \n\t"
+		"LSR %[delay] \n\t"
+		"LSR %[delay] \n\t"
+		"INC %[delay] \n\t"					// So a delay under 4 still goes round once
+		"L_wait%=:DEC %[delay] \n\t"
+		"NOP \n\t"
+		"BRNE L_wait%= \n\t"
+		"OUT %[port],%[value] \n\t"			// Next LEDs off
+		"DEC %[count] \n\t"
+		"BRNE L_next%= \n\t"
+		"OUT %[ddr],__zero_reg__ \n\t"		// All off by now anyway, but leave DDRB=0 like ledDutyCycle() does
+		: [value] "=&r" (value) , [delay] "=&r" (delay) , "+z" (events) , [count] "+r" (count)
+		: [ddr] "I" (_SFR_IO_ADDR(DDRB)) , [port] "I" (_SFR_IO_ADDR(PORTB)) , [on] "r" (ddrbbits)
+		: "memory"							// Reads events[] through Z, so the compiler has to have stored it all first
+	);
+}
+
+// Light the LEDs in this row that are on PORTB all at once and turn each one off at its own time, shortest first, so the row
+// takes about as long as its brightest LED rather than all of them added up. LEDs that are too short, or too close to the one
+// before to fit an event in between, get left for the one-at-a-time loop. Returns a bit for each column it did.
+//
+// LEDs go off by bringing the col pin to the same level as the row pin rather than letting it float, since a floating col pin
+// that is set high would turn on its pull-up and leak a little into the LED.
+
+static inline byte ledChainRow( byte const *row , byte portBRowBitsCache , byte rowHigh )
+{
+	byte order[COLS];			// Columns we might chain, shortest first
+	byte candidates = 0;
+
+	for( byte x = 0 ; x < COLS ; x++ ) {
+		byte b = row[x];
+
+		if ( b >= CHAIN_GAP && portBColBit(x) ) {		// PORTD col has to go one at a time
+			byte i = candidates++;
+
+			while ( i && row[ order[i-1] ] > b ) {
+				order[i] = order[i-1];
+				i--;
+			}
+
+			order[i] = x;
+		}
+	}
+
+	byte events[COLS*2];		// PORTB col bits going off (value once we know them all), then the delay
+	byte eventCount = 0;
+	byte chainBits = 0;			// PORTB bits of the cols we chained
+	byte chainCols = 0;			// Same thing as a bit per x, to hand back
+	byte last = 0;				// When the last event goes
+
+	for( byte i = 0 ; i < candidates ; i++ ) {
+		byte x = order[i];
+		byte b = row[x];
+		byte colBit = portBColBit(x);
+
+		if ( eventCount && b==last ) {						// Goes off at the same time as the one before, so same event
+			events[ (eventCount-1)*2 ] |= colBit;
+		} else if ( (byte) (b-last) >= CHAIN_GAP ) {
+			events[ eventCount*2 ] = colBit;
+			events[ eventCount*2+1 ] = b - last - CHAIN_GAP;
+			eventCount++;
+			last = b;
+		} else {
+			continue;
+		}
+
+		chainBits |= colBit;
+		chainCols |= _BV(x);
+	}
+
+	if (eventCount) {
+		byte portBOn = rowHigh ? portBRowBitsCache : chainBits;		// Row pin high and cols low, or the other way round
+		byte off = 0;
+
+		for( byte e = 0 ; e < eventCount ; e++ ) {
+			off |= events[e*2];
+			events[e*2] = portBOn ^ off;							// Flipping a col bit brings it level with the row
+		}
+
+		PORTB = portBOn;
+		ledChain( portBRowBitsCache | chainBits , events , eventCount );
+	}
+
+	return chainCols;
+}
+
+#endif
+
+#ifdef BAM
+
+#if defined(INTERPOLATE) || defined(CONCURRENT_ROWS)
+	#error "BAM is its own way of driving the LEDs, so it doesn't go with INTERPOLATE or CONCURRENT_ROWS"
+#endif
+
+#ifndef DOUBLE_BUFFER
+	#error "BAM needs DOUBLE_BUFFER, since the PD6 col is drawn from fda[] and would show half decoded frames"
+#endif
+
+// Bit angle modulation. Rather than each LED getting its duty cycle in one go, a row gets 8 planes, one per duty cycle bit, that last
+// 128,64,32...1 cycles. Every LED in the row whose duty cycle has that bit set is on for that plane, so each one still gets exactly its
+// duty cycle in cycles and a row always takes 255 of them. The 3 long planes (224 of the 255) are timed by Timer0 while we sleep in
+// Idle, the rest are counted out since they are too short to sleep though.
+//
+// Only the cols on PORTB. The PD6 col still goes one LED at a time.
+
+#define BAM_PLANES 8
+
+// Cycles from the OUT that starts a timed plane to the OUT that starts the next one, on top of OCR0A...
+//		OUT TCNT0 right after the start								1
+//		Timer0 gets to OCR0A, flag set one timer clock later		1
+//		Wake from Idle (4) plus interrupt response (4)				8
+//		RJMP in the vector table, RETI from the empty ISR			6
+//		OUT OCR0A (or NOP) after the SLEEP, then the OUT itself		2
+//																	===
+//																	18
+// This is worked out from the datasheet and needs checking with a scope on a real candle.
+
+#define BAM_WAKE_CYCLES 18
+
+EMPTY_INTERRUPT( TIMER0_COMPA_vect );		// Only here to wake us up
+
+// PORTB value for each plane of each row, longest plane first. The cols that should be on for that plane are driven away from the row
+// pin and the rest level with it, so with DDRB set for the row and all the PORTB cols, changing planes is a single OUT to PORTB.
+
+byte bamPlanes[ROWS][BAM_PLANES];
+
+// Cut fda[] up into planes. Called from showFrame() once per new frame rather than every refresh.
+
+static void bamSlice(void) {
+	byte const *fdaptr = fda;
+
+	for( byte y = 0 ; y < ROWS ; y++ ) {
+		byte *planes = bamPlanes[y];
+
+		memset( planes , 0 , BAM_PLANES );
+
+		for( byte x = 0 ; x < COLS ; x++ ) {
+			byte b = *(fdaptr++);
+			byte colBit = portBColBit(x);
+
+			for( byte p = BAM_PLANES ; p > 0 ; p-- ) {		// Low bit of b is the last plane
+				if (b & 0x01) planes[p-1] |= colBit;
+				b >>= 1;
+			}
+		}
+
+		if ( rowDirectionBits & _BV(y) ) {					// Row pin high, so lit cols go low and the rest high with the row
+			byte flip = portBRowBit(y) | ALL_PORTB_COLS;
+
+			for( byte p = 0 ; p < BAM_PLANES ; p++ ) planes[p] ^= flip;
+		}
+	}
+}
+
+// Run all 8 planes for one row. (ddrbbits) is the row pin and all the PORTB col pins.
+
+static inline void bamRow( byte const *planes , byte ddrbbits )
+{
+	byte value;
+	byte lastValue;
+	byte t;
+
+	__asm__ __volatile__ (
+		"LDD %[last],Z+7 \n\t"					// No time to load the 1 cycle plane when we get to it
+		"LD %[value],Z+ \n\t"
+		"LDI %[t],%[ocr7] \n\t"
+		"OUT %[ocr],%[t] \n\t"
+		"OUT %[port],%[value] \n\t"			// Levels for the 128 cycle plane, but nothing is on yet with DDRB=0
+		"LD %[value],Z+ \n\t"
+		"LDI %[t],%[ocr6] \n\t"
+		"OUT %[ddr],%[on] \n\t"				// 128 cycle plane starts
+		"OUT %[tcnt],__zero_reg__ \n\t"
+		"SLEEP \n\t"
+		"OUT %[ocr],%[t] \n\t"
+		"OUT %[port],%[value] \n\t"			// 64
+		"OUT %[tcnt],__zero_reg__ \n\t"
+		"LD %[value],Z+ \n\t"
+		"LDI %[t],%[ocr5] \n\t"
+		"SLEEP \n\t"
+		"OUT %[ocr],%[t] \n\t"
+		"OUT %[port],%[value] \n\t"			// 32
+		"OUT %[tcnt],__zero_reg__ \n\t"
+		"LD %[value],Z+ \n\t"
+		"SLEEP \n\t"
+		"NOP \n\t"							// Stands in for the OUT OCR0A so the 32 plane wakes like the others
+		"OUT %[port],%[value] \n\t"			// 16
+		"LD %[value],Z+ \n\t"					// 2
+		"LDI %[t],4 \n\t"						// 1
+		"L_16%=:DEC %[t] \n\t"				// 3*4-1
+		"BRNE L_16%= \n\t"
+		"NOP \n\t"							// 1
+		"OUT %[port],%[value] \n\t"			// 8
+		"LD %[value],Z+ \n\t"					// 2
+		"RJMP .+0 \n\t"						// 2
+		"RJMP .+0 \n\t"						// 2
+		"NOP \n\t"							// 1
+		"OUT %[port],%[value] \n\t"			// 4
+		"LD %[value],Z+ \n\t"					// 2
+		"NOP \n\t"							// 1
+		"OUT %[port],%[value] \n\t"			// 2
+		"NOP \n\t"							// 1
+		"OUT %[port],%[last] \n\t"			// 1
+		"OUT %[ddr],__zero_reg__ \n\t"		// Row done
+		: [value] "=&r" (value) , [last] "=&r" (lastValue) , [t] "=&d" (t) , "+z" (planes)
+		: [ddr] "I" (_SFR_IO_ADDR(DDRB)) , [port] "I" (_SFR_IO_ADDR(PORTB)) , [on] "r" (ddrbbits) ,
+		  [ocr] "I" (_SFR_IO_ADDR(OCR0A)) , [tcnt] "I" (_SFR_IO_ADDR(TCNT0)) ,
+		  [ocr7] "M" (128-BAM_WAKE_CYCLES) , [ocr6] "M" (64-BAM_WAKE_CYCLES) , [ocr5] "M" (32-BAM_WAKE_CYCLES)
+		: "memory"								// Reads planes[] through Z
+	);
+}
+
+#endif
+
+#ifdef DISPLAY_LIST
+
+#if defined(INTERPOLATE) || defined(CONCURRENT_ROWS) || defined(BAM)
+	#error "DISPLAY_LIST is its own way of driving the LEDs, so it doesn't go with INTERPOLATE, CONCURRENT_ROWS or BAM"
+#endif
+
+#ifdef DOUBLE_BUFFER
+	#error "DISPLAY_LIST takes the place of DOUBLE_BUFFER, and there isn't the RAM for both. Turn off DOUBLE_BUFFER in candle.h."
+#endif
+
+// Everything refreshScreenClean() needs to light each LED that is on, worked out once per frame rather than on every refresh.
+// The PORTB cols come first, with DDRD off the whole time. Then the PD6 col, first the rows that go low (PORTD high) and
+// then the rows that go high (PORTD low), so PORTD and DDRD only get set twice per refresh rather than for every LED.
+
+typedef struct {
+	byte portb;
+	byte ddrb;
+	dutycycle cycles;
+} displayentry;
+
+displayentry displayList[FDA_SIZE];
+byte displayListPortDLow;			// First PD6 entry with the row low
+byte displayListPortDHigh;			// First PD6 entry with the row high
+byte displayListCount;
+
+// Add every lit LED from fda[] that is on a col in (portDCols) and (when it's on PORTD) in a row going (rowHigh) to the display list
+
+static void addToDisplayList( byte portDCols , byte rowHigh ) {
+	dutycycle const *fdaptr = fda;
+	displayentry *e = displayList + displayListCount;
+
+	for( byte y = 0 ; y < ROWS ; y++ ) {
+		byte high = rowDirectionBits & _BV(y) ? 1 : 0;
+
+		for( byte x = 0 ; x < COLS ; x++ ) {
+			dutycycle b = *(fdaptr++);
+
+			if ( b && (portDColBit(x) == portDCols) && ( !portDCols || high==rowHigh ) ) {
+				e->portb = high ? portBRowBit(y) : portBColBit(x);
+				e->ddrb = portBRowBit(y) | portBColBit(x);
+				e->cycles = b;
+				e++;
+			}
+		}
+	}
+
+	displayListCount = e - displayList;
+}
+
+// Called from showFrame() once per new frame
+
+static void buildDisplayList(void) {
+	displayListCount = 0;
+	addToDisplayList( 0 , 0 );
+	displayListPortDLow = displayListCount;
+	addToDisplayList( ALL_PORTD_COLS , 0 );
+	displayListPortDHigh = displayListCount;
+	addToDisplayList( ALL_PORTD_COLS , 1 );
+}
+
+// Light the LEDs in display list entries (e) up to (end), one at a time
+
+static inline void showDisplayList( displayentry const *e , displayentry const *end ) {
+	while ( e < end ) {
+		PORTB = e->portb;
+		ledOn( e->cycles , e->ddrb );
+		e++;
+	}
+}
+
+#endif
+
+#ifdef UNROLLED_REFRESH
+
+#if defined(CONCURRENT_ROWS) || defined(BAM) || defined(DISPLAY_LIST) || defined(DITHER)
+	#error "UNROLLED_REFRESH is its own way of driving the LEDs, so it doesn't go with CONCURRENT_ROWS, BAM, DISPLAY_LIST or DITHER"
+#endif
+
+// Not inline, or we'd get a copy of all of ledDutyCycle() for every LED
+
+static void __attribute__((noinline)) ledOnUnrolled( dutycycle cycles , byte ledonbits ) {
+	ledOn( cycles , ledonbits );
+}
+
+// One LED. Everything but b is a constant, so the ifs and ?:s all go away at compile time.
+// PORTD and DDRD are both 0 in between LEDs, so PORTB cols don't need to touch PORTD at all. A PD6 LED has to put PORTD back
+// as well as DDRD, or a 1 left in PORTD turns on PD6's pull-up and the LED at that col ghosts while the rest of the row is lit.
+
+#define UNROLLED_LED( x , colPortB , colPortD , y , rowPortB , rowHigh )	{	\
+	dutycycle b = f[ ( (y) * WIDTH ) + (x) ];									\
+	if (b) {																	\
+		PORTB = (rowHigh) ? (rowPortB) : (colPortB);							\
+		if (colPortD) {															\
+			PORTD = (rowHigh) ? 0 : (colPortD);									\
+			DDRD = (colPortD);													\
+		}																		\
+		ledOnUnrolled( b , (rowPortB) | (colPortB) );							\
+		if (colPortD) {															\
+			DDRD = 0;															\
+			PORTD = 0;															\
+		}																		\
+	}																			\
+}
+
+#define UNROLLED_ROW( y , rowPortB , rowHigh , ... )	BOARD_COLS( UNROLLED_LED , y , rowPortB , rowHigh )
+
+static inline void refreshUnrolled(void) {
+	dutycycle const *f = fda;
+
+	BOARD_ROWS( UNROLLED_ROW )
+}
+
+#endif
+
+#ifdef GOVERNOR
+
+#define GOVERNOR_SETTLE_US 100		// Bandgap start up is 70us worst case, and PB1 has to settle through the LEDs too
+
+// Is the battery below about 2.2V? Done at the top of a wake, while all the LEDs are still off.
+// GOVERNOR_DIVIDER_HIGH high and GOVERNOR_DIVIDER_LOW low put two LEDs in series with PB1 (AIN1) between them. They both carry
+// the same tiny current, well under where they would light, so PB1 sits at about half the supply. ACBG puts the 1.1V bandgap
+// on the comparator's other input, so ACO comes out set once half the supply is below that.
+
+static inline byte supplyLow(void) {
+	ACSR = _BV(ACBG);
+	PORTB = GOVERNOR_DIVIDER_HIGH;
+	DDRB = GOVERNOR_DIVIDER_HIGH | GOVERNOR_DIVIDER_LOW;
+	_delay_us( GOVERNOR_SETTLE_US );
+	byte low = ACSR & _BV(ACO);
+	DDRB = 0;
+	PORTB = 0;
+	ACSR = 0;						// Back how reset leaves it, with the bandgap off
+	return low;
+}
+
+// Take a sample every GOVERNOR_SAMPLE_REFRESHES wakes, and work out if this refresh is one a skip tier leaves dark
+
+static inline void governorWake(void) {
+	if (governorCountdown) {
+		governorCountdown--;
+	} else {
+		governorCountdown = GOVERNOR_SAMPLE_REFRESHES;
+		governorUpdate( supplyLow() );
+	}
+
+	if (governorTier >= GOVERNOR_SKIP_TIER) {
+		governorDark ^= 1;
+	} else {
+		governorDark = 0;
+	}
+}
+
+#endif
+
+#ifdef LIGHT_SENSE
+
+#ifdef TIMER1_WAKE
+	#error "LIGHT_SENSE needs the watchdog wake, since it stretches the watchdog timeout to sleep through the day"
+#endif
+
+#if ( LIGHT_SENSE_ANODE | LIGHT_SENSE_CATHODE ) & ALL_PORTD_COLS
+	#error "LIGHT_SENSE_ANODE and LIGHT_SENSE_CATHODE have to be spare PORTD pins, not ones in BOARD_COLS"
+#endif
+
+// We reverse bias the sense LED at the end of a wake and leave its cathode floating while we sleep. Its own capacitance
+// holds the charge, and light makes a photocurrent that drains it. If the cathode reads low by the next wake, the room
+// is bright. The watchdog reset puts the anode pin back to an input, but only once the sleep is over.
+
+#define LIGHT_SENSE_SAMPLE_REFRESHES ((word) LIGHT_SENSE_SAMPLE_SECONDS * REFRESH_RATE)
+
+// warmstart() skips the .data and .bss init, so all these carry over from one wake to the next
+
+static byte lightSenseDaylight;			// Too bright to bother showing anything, so just sleeping and checking
+static byte lightSenseArmed;			// Charged the sense LED at the end of the last wake, so read it at the top of this one
+static byte lightSenseRun;				// Samples in a row that disagree with lightSenseDaylight
+static word lightSenseCountdown;		// Refreshes until the next sample while we are showing
+
+// Count one sample towards switching between showing and daylight. Kept apart from the pins so a simulation can feed it
+// whatever readings it likes.
+
+static void lightSenseUpdate( byte bright ) {
+	if ( bright == lightSenseDaylight ) {
+		lightSenseRun = 0;
+	} else if ( ++lightSenseRun >= LIGHT_SENSE_SAMPLES ) {
+		lightSenseRun = 0;
+		lightSenseDaylight = bright;
+	}
+}
+
+// Cathode high and anode low to charge the sense LED backwards, then let the cathode float. Only a few cycles.
+
+static inline void lightSenseCharge(void) {
+	PORTD = LIGHT_SENSE_CATHODE;
+	DDRD = LIGHT_SENSE_CATHODE | LIGHT_SENSE_ANODE;
+	DDRD = LIGHT_SENSE_ANODE;			// Cathode to input. Pull-up is still on for a cycle, which doesn't hurt.
+	PORTD = 0;
+	lightSenseArmed = 1;
+}
+
+// Called at the top of each wake, before the refresh touches any pins. Returns 1 if it is daylight and there is nothing
+// to show this wake.
+//
+// In daylight we take turns between a long sleep (LIGHT_SENSE_DAYLIGHT_WDTO) and a normal 16ms one with the sense LED
+// charged, so the sample always gets the same 16ms to drain however long we slept before it.
+
+static inline byte lightSenseWake(void) {
+	if (lightSenseArmed) {
+		lightSenseArmed = 0;
+		lightSenseUpdate( !( PIND & LIGHT_SENSE_CATHODE ) );
+
+		if (lightSenseDaylight) {
+			wdt_enable( LIGHT_SENSE_DAYLIGHT_WDTO );
+			return 1;
+		}
+
+		lightSenseCountdown = LIGHT_SENSE_SAMPLE_REFRESHES;
+		return 0;
+	}
+
+	if (lightSenseDaylight) {		// Just woke from a long sleep
+		lightSenseCharge();
+		return 1;
+	}
+
+	return 0;
+}
+
+// Called at the end of each wake we showed, so the sample gets the whole sleep before the next one
+
+static inline void lightSenseShown(void) {
+	if (lightSenseCountdown) {
+		lightSenseCountdown--;
+	} else {
+		lightSenseCharge();
+	}
+}
+
+#endif
+
 // Do a single full screen refresh     
 // call nextframe() to decode next frame into buffer afterwards if it is time
 // This version will work with any combination of row/col bits
@@ -376,8 +1871,44 @@ static inline void refreshScreenClean(void)
 		DDRA = _BV(0)|_BV(1);		// Set PORTA0 for output. Use OR because it compiles to single SBI instruction
 		PORTA |=_BV(0);				// twiddle A0 bit for oscilloscope timing
 	#endif
+
+	#ifdef BAM
+		TCCR0B = _BV(CS00);			// Timer0 counting cycles for bamRow(). Everything is back to reset values each time the WDT wakes us, so do this every time.
+		TIMSK |= _BV(OCIE0A);
+		MCUCR = _BV( SE );			// Idle, so Timer0 keeps going. warmstart() puts it back to Power Down before we go to sleep for real.
+		sei();
+	#endif
+
+	#ifdef DITHER
+		// 0,2,1,3 rather than 0,1,2,3 so a code that is half way between gets its extra cycle every other refresh rather
+		// than two on, two off. Bit reversing the bottom 2 bits of the count does that.
+		ditherPhase++;
+		byte ditherThreshold = ( (ditherPhase & 0x01) << 1 ) | ( (ditherPhase >> 1) & 0x01 );
+	#endif
+
+#ifdef GOVERNOR
+	if (!governorDark) {			// Frame clock below still runs on the dark ones
+#endif
+	
+#ifdef DISPLAY_LIST
+
+	showDisplayList( displayList , displayList + displayListPortDLow );
+
+	PORTD = ALL_PORTD_COLS;			// Col high for the rows that go low
+	DDRD = ALL_PORTD_COLS;
+	showDisplayList( displayList + displayListPortDLow , displayList + displayListPortDHigh );
+
+	PORTD = 0;						// Col low for the rows that go high
+	showDisplayList( displayList + displayListPortDHigh , displayList + displayListCount );
+	DDRD = 0;
+
+#elif defined(UNROLLED_REFRESH)
+
+	refreshUnrolled();
+
+#else
 	
-	byte *fdaptr = fda;		 // Where are we in scanning through the FDA?
+	dutycycle *fdaptr = fda;		 // Where are we in scanning through the FDA?
 	
 	byte rowDirectionBitsRotating = rowDirectionBits;	// Working space for rowDirections bits that we shift down once for each row
 
@@ -385,17 +1916,40 @@ static inline void refreshScreenClean(void)
 	// TODO: in ASM, would could shift though the carry flag and jmp based on that and save a bit test
 	
 	for( byte y = 0 ; y < FDA_Y_MAX ; y++ ) {
-		byte portBRowBitsCache = portBRowBits[y]; 
-		byte portDRowBitsCache = portDRowBits[y]; 
+		byte portBRowBitsCache = portBRowBit(y); 
+		byte portDRowBitsCache = portDRowBit(y); 
+
+#ifdef CONCURRENT_ROWS
+		byte chainCols = ledChainRow( fdaptr , portBRowBitsCache , rowDirectionBitsRotating & _BV(0) );
+#endif
+
+#ifdef BAM
+		bamRow( bamPlanes[y] , portBRowBitsCache | ALL_PORTB_COLS );
+#endif
 		
 		for( byte x = 0 ; x < FDA_X_MAX ; x++) {
 			// get the brightness of the current LED
-			register byte b = *( fdaptr++ );		// Want this in a register because later we will loop on it and want the loop entrance to be quick
+			register dutycycle b = *( fdaptr++ );		// Want this in a register because later we will loop on it and want the loop entrance to be quick
+
+#ifdef DITHER
+			if ( b < DITHER_CODES ) {			// Dim enough to be a dither code rather than a cycle count
+				byte q = pgm_read_byte_near( &ditherQuarters[b] );
+				b = ( q >> 2 ) + ( ( q & 0x03 ) > ditherThreshold );
+			}
+#endif
+
+#ifdef CONCURRENT_ROWS
+			if ( chainCols & _BV(x) ) continue;		// Already done
+#endif
+
+#ifdef BAM
+			if ( portBColBit(x) ) continue;		// bamRow() did these
+#endif
 			
 			// If the LED is off, then don't need to do anything since all LEDs are already off all the time except for a split second inside this routine....
 			if (b>0) {
-				byte portBColBitsCache = portBColBits[x]; 
-				byte portDColBitsCache = portDColBits[x]; 
+				byte portBColBitsCache = portBColBit(x); 
+				byte portDColBitsCache = portDColBit(x); 
 				
 				// Assume DDRB = DDRD = 0 coming into the INt since that is the Way we should have left them when we exited last...
 				byte ddrbt;
@@ -417,24 +1971,57 @@ static inline void refreshScreenClean(void)
 				}
 				
 				DDRD = ddrdt;
-				ledDutyCycle( b , ddrbt );
+				ledOn( b , ddrbt );
 				DDRD = 0x00;
 			}
 		}
 		
 		rowDirectionBitsRotating >>= 1;		// Shift bits down so bit 0 has the value for the next row
 	}
+
+#endif
+
+#ifdef GOVERNOR
+	}
+#endif
+
+	#ifdef BAM
+		TCCR0B = 0;					// Stop Timer0 so it doesn't wake us again
+	#endif
 	
 	#ifdef TIMECHECK
 		PORTA &= ~_BV(0);
 	#endif
+
+#ifdef INTERPOLATE
+	if (interpolateStepsLeft) {			// Next step towards the frame showFrame() last got
+		interpolateStepsLeft--;
+
+		for( byte i = 0 ; i < FDA_SIZE ; i++ ) {
+			fda[i] += fdaStep[i];
+		}
+	}
+#endif
 	
-	refreshCount--;
-	if (refreshCount == 0 ) {			// step to next frame in the animation sequence?
-		refreshCount=REFRESH_PER_FRAME+1;
+	frameClock += FRAME_RATE;
+	if (frameClock >= REFRESH_RATE ) {			// step to next frame in the animation sequence?
+		frameClock -= REFRESH_RATE;
 		// Update the display buffer with the next frame of animation
 		nextFrame();
 	}
+#if DECODE_SLICES > 1
+	else if (decodeSlicesLeft) {		// Keep going with the frame nextFrame() started, a slice per wake
+		#ifdef TIMECHECK
+			PORTA |= _BV(1);
+		#endif
+
+		decodeSlice();
+
+		#ifdef TIMECHECK
+			PORTA &= ~_BV(1);
+		#endif
+	}
+#endif
 }
 
 void init0 (void) __attribute__ ((naked)) __attribute__ ((section (".init0")));
@@ -450,9 +2037,58 @@ void init0(void) {
 
 // TODO: Make our own linker script and move warmstart here so we save one cycle on the RJMP, and instead take that hit only once with a jump to main() on powerup
 
+// This is "static inline" so The code will just be inserted directly into the warmstart code avoiding overhead of a call/ret
+// Important that this function always finishes before WDT expires or it will get cut short
+static inline void userWakeRoutine(void) {
+#ifdef LIGHT_SENSE
+	if (lightSenseWake()) return;
+#endif
+#ifdef GOVERNOR
+	governorWake();
+#endif
+	refreshScreenClean();
+#ifdef LIGHT_SENSE
+	lightSenseShown();
+#endif
+}
+
+#ifdef TIMER1_WAKE
+
+EMPTY_INTERRUPT( TIMER1_COMPA_vect );		// Only here to wake us up, the work gets done back in main()
+
+#endif
+
 // Main() only gets run once, when we first power up
 int main(void)
 {
+	#ifdef EEPROM_RESUME
+		loadResumePoint();
+	#endif
+
+#ifdef TIMER1_WAKE
+
+	// Timer1 counts the crystal (well, the calibrated RC) instead of the watchdog's own loose oscillator, so the refresh rate
+	// is as good as F_CPU. The catch is that the clock has to keep running, so we can only go down to Idle rather than Power Down.
+
+	#ifdef DEBUG
+		CLKPR = _BV(CLKPCE);				// Same as warmstart() would do on each wake
+		CLKPR = CLOCK_PRESCALE;
+	#endif
+
+	OCR1A = ( F_CPU / 8 / REFRESH_RATE ) - 1;
+	TCCR1B = _BV(WGM12) | _BV(CS11);				// Clear on compare match with OCR1A, clock/8
+	TIMSK = _BV(OCIE1A);
+	sei();
+
+	MCUCR = _BV( SE );								// Sleep enable, and sets sleep mode to Idle
+
+	for(;;) {
+		asm("sleep");
+		userWakeRoutine();
+	}
+
+#else
+
 	wdt_enable(WDTO_15MS);							// Could do this slightly more efficiently in ASM, but we only do it one time- when we first power up
 	
 	// The delay set here is actually just how long until the first watchdog reset so we will set it to the lowest value to get into cycyle as soon as possible
@@ -466,15 +2102,11 @@ int main(void)
 	asm("sleep");
 	
 	// we should never get here
-}
-
 
-// This is "static inline" so The code will just be inserted directly into the warmstart code avoiding overhead of a call/ret
-// Important that this function always finishes before WDT expires or it will get cut short
-static inline void userWakeRoutine(void) {
-	refreshScreenClean();
+#endif
 }
 
+
 void  __attribute__ ((naked)) warmstart(void) {
 	// Set the timeout to the desired value. Do this first because by default right now it will be at the inital value of 16ms
 	// which might not be long enough for us to do what we need to do before the WatchDog times out and does a reset.
@@ -482,7 +2114,7 @@ void  __attribute__ ((naked)) warmstart(void) {
 	// Note that we do not have to set WDTCR because the default timeout is initialized to 16ms after a reset (which is now). This is ~60Hrz display refresh rate.
 	#ifdef DEBUG							// In production build, the FUSE will already have us start at full speed
 		CLKPR = _BV(CLKPCE);				// Enable changes to the clock prescaler
-		CLKPR = 0;							// Set prescaler to 1, we will run full speed						
+		CLKPR = CLOCK_PRESCALE;				// Set prescaler back to what the non-DEBUG fuses would give us, so we run at F_CPU
 											// TODO: Check if running full speed uses more power than doing same work longer at half speed
 	#endif
 	
@@ -1,13 +1,12 @@
 /*
  * VideoBitStream.c
  *
- * Created: 11/17/2013 2:10:00 PM
- *  Author: josh
+ * Generated by VideoEncoder - do not edit by hand, edit the frames and re-encode.
  */ 
 
 // Holds the actual compressed video bitstream data.
 // this is stored in program memory flash and must be accessed with
-// the 
+// the pgm_read_byte() functions.
 
 
 #include <avr/pgmspace.h>
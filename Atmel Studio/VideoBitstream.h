@@ -1,12 +1,9 @@
-#define FRAME_RATE 15				// Frames per second
+// Generated by VideoEncoder along with VideoBitStream.c - do not edit by hand
 
-#define	WIDTH 	5
-#define	HEIGHT	8
-
-#define BRIGHTNESSBITS 5
+#define	FRAMECOUNT	((framecounttype) 195)
 
-typedef byte framecounttype;		// Define this type in case we ever go over 255 frames we can switch to an unsigned int
+#define	VIDEOBITSTREAM_FORMAT	BITSTREAM_CLASSIC
 
-#define	FRAMECOUNT	((framecounttype) 195)
+#define	VIDEOBITSTREAM_MAX_BRIGHTNESS	31
 
 extern byte PROGMEM const videobitstream[];
@@ -2,3 +2,166 @@
 
 typedef unsigned char byte;			// Define a byte
 typedef unsigned int word;			// Define a word
+
+// CPU clock. 8Mhz, or 4Mhz or 1Mhz to keep running as the battery gets down towards 1.8V. The fuses and the duty cycles
+// follow it, so the LEDs stay on for the same time whatever the clock. Can also be set from the compiler command line.
+
+#ifndef F_CPU
+	#define F_CPU 8000000UL
+#endif
+
+#define FRAME_RATE 15				// Frames per second
+#define REFRESH_RATE 62				// Screen refreshes per second. Has to be 62 unless TIMER1_WAKE, since that is how often the 16ms watchdog wakes us.
+
+// Wake up for each refresh from Timer1 rather than a watchdog reset. The watchdog oscillator is only good to about 10%
+// and drifts with voltage and temperature, so this gets REFRESH_RATE (and so FRAME_RATE) as close as F_CPU is. Sleeps in
+// Idle rather than Power Down in between, so it costs more current.
+
+//#define TIMER1_WAKE
+
+#define	WIDTH 	5
+#define	HEIGHT	8
+
+// How the LEDs are wired up on the board. Candle0005.c works out its pin tables from these, so a new board revision
+// only has to change them here. Checked at compile time so a slip can't quietly scramble the picture.
+//
+// BOARD_ROWS has one ROW( y , PORTB bit , high ) per row of fda[], bottom up and in order. high is 1 if the row pin goes high
+// to light the row (so the col pin goes low), 0 if the other way round. Rows have to be on PORTB since the LEDs are timed with DDRB.
+// BOARD_COLS has one COL( x , PORTB bit , PORTD bit ) per col, left to right. Each col is on one or the other, so one of them is 0.
+// Anything after those in a ROW() or COL() is passed through from the BOARD_ROWS() or BOARD_COLS() call.
+
+#define BOARD_ROWS( ROW , ... )				\
+	ROW( 0 , _BV(0) , 1 , __VA_ARGS__ )		\
+	ROW( 1 , _BV(0) , 0 , __VA_ARGS__ )		\
+	ROW( 2 , _BV(2) , 1 , __VA_ARGS__ )		\
+	ROW( 3 , _BV(2) , 0 , __VA_ARGS__ )		\
+	ROW( 4 , _BV(4) , 1 , __VA_ARGS__ )		\
+	ROW( 5 , _BV(4) , 0 , __VA_ARGS__ )		\
+	ROW( 6 , _BV(6) , 1 , __VA_ARGS__ )		\
+	ROW( 7 , _BV(6) , 0 , __VA_ARGS__ )
+
+#define BOARD_COLS( COL , ... )				\
+	COL( 0 , _BV(7) ,      0 , __VA_ARGS__ )	\
+	COL( 1 , _BV(5) ,      0 , __VA_ARGS__ )	\
+	COL( 2 , _BV(3) ,      0 , __VA_ARGS__ )	\
+	COL( 3 , _BV(1) ,      0 , __VA_ARGS__ )	\
+	COL( 4 ,      0 , _BV(6) , __VA_ARGS__ )
+
+#define BRIGHTNESSBITS 5			// Must match BRIGHTNESSBITS in the encoder
+
+// How many CPU cycles (at 8Mhz) a full on LED gets each refresh. 255 is the original 8 bit table. Bigger makes the table from a curve
+// with this at the top, so the bright end is brighter and the dimmest level is a smaller share of full. Duty cycles then
+// take a word each (twice the frame buffer RAM) and longer on-times, but only if the clip actually uses a level that comes
+// out past 255. Otherwise it builds the same 8 bit code as always. Up to about 1600 at 62Hz before refreshes get too long.
+// Word duty cycles leave no room for INTERPOLATE or DISPLAY_LIST.
+
+#define FULL_ON_DUTYCYCLE 255
+
+// Spend the bottom 16 brightness levels on 0.5 to 14.5 cycles, in steps as small as half a cycle, by alternating each LED
+// between the cycle counts either side over 4 refreshes. Dim embers get about twice as many levels with half the step
+// between them, and the bright end gets fewer. Costs 1 byte of RAM and about 2 cycles per pixel each refresh, plus about
+// 12 more for each LED that is on a dim level. The video has to be encoded with -D to match.
+
+//#define DITHER
+
+typedef byte framecounttype;		// Define this type in case we ever go over 255 frames we can switch to an unsigned int
+
+// Which bitstream format nextFrame() decodes. Must match the -f option the encoder was run with (checked at compile time)
+
+#define BITSTREAM_CLASSIC	0		// 1 bit per unchanged pixel, 1+BRIGHTNESSBITS per changed pixel
+#define BITSTREAM_RLE		1		// Runs of unchanged pixels coded as Exp-Golomb run lengths, each followed by a changed pixel
+#define BITSTREAM_HUFFMAN	2		// Like classic, but new brightness values are Huffman coded with tables the encoder builds for the clip
+#define BITSTREAM_DELTA		3		// Like classic, but new brightness values are usually small steps from the old one. Costs FDA_SIZE bytes of RAM.
+#define BITSTREAM_SPATIAL	4		// Like delta, but each changed pixel is predicted from the step its neighbour just took. Scan order comes from VideoBitstream.h.
+
+#define BITSTREAM_FORMAT BITSTREAM_CLASSIC
+
+// Orders BITSTREAM_SPATIAL can visit the pixels in. The encoder picks one and puts it in VideoBitstream.h as VIDEOBITSTREAM_SCAN_ORDER.
+
+#define SCAN_ROWS		0		// fda[FDA_SIZE-1] down to fda[0], same as every other format
+#define SCAN_COLUMNS	1		// Up each column from the bottom, left column first, so the neighbour is the pixel below
+#define SCAN_SERPENTINE	2		// Up the first column, down the next, and so on
+
+// Uncomment to decode BITSTREAM_CLASSIC with lookup tables that skip runs of unchanged pixels and read brightness fields in one step
+// rather than one bit per loop. Same stream, same output, fewer cycles per frame but costs 48 bytes of flash tables plus the extra code.
+
+//#define TABLE_DECODE
+
+// How many wakes to spread decoding each frame over. 1 decodes the whole frame in the wake that starts it, which makes
+// that wake much longer than the others. More slices even that out. Each slice is (WIDTH*HEIGHT)/DECODE_SLICES pixels
+// (4 is 2 rows), so this has to divide evenly into that, and should be no more than REFRESH_RATE/FRAME_RATE, the fewest wakes between frames.
+// Pixels later in the stream change up to DECODE_SLICES-1 refreshes after the first ones.
+
+#define DECODE_SLICES 4
+
+// Decode into a second frame buffer and only swap it onto the screen once the whole frame is in, so a frame decoded over
+// several wakes never shows half old and half new. Costs WIDTH*HEIGHT bytes of RAM plus 2 pointers, and a copy of the frame each time one is shown.
+
+#define DOUBLE_BUFFER
+
+// Slide each pixel from the old frame to the new one over the refreshes in between, rather than holding each frame flat
+// for all of them. Smoother fades, especially at low brightness. Needs DOUBLE_BUFFER, plus WIDTH*HEIGHT more bytes of RAM
+// for the steps, and adds a pass over the frame to each refresh while it is sliding.
+
+//#define INTERPOLATE
+
+// Light all the LEDs in a row that share PORTB at once and turn each off at its own time, rather than one LED at a time.
+// Each LED still gets exactly the same number of cycles, but a row only takes about as long as its brightest LED. The row
+// pin has to carry up to 4 LEDs' worth of current though, so if it sags they can come out a little dimmer than one at a time.
+
+//#define CONCURRENT_ROWS
+
+// Drive the LEDs with bit angle modulation. Each row lights for 8 planes of 128,64,...1 cycles, each showing one bit of every
+// LED's duty cycle. The CPU sleeps in Idle through the long planes while Timer0 times them, rather than sitting in a busy loop.
+// Same brightness as the busy loop, but every row always takes 255 cycles. Costs 64 bytes of RAM for the planes. Only the
+// PORTB cols get planes. The PD6 col is still drawn one LED at a time straight from fda[], so this needs DOUBLE_BUFFER too.
+
+//#define BAM
+
+// Work out the port values for every lit LED once per frame, so each refresh is just a run down a list rather than looking
+// everything up again for all 40 pixels. The list only changes once a whole frame is in, so it takes the place of DOUBLE_BUFFER,
+// which has to be off. Costs 3 bytes of RAM per pixel. That is about 175 bytes of globals in all, leaving about 80 for the stack.
+
+//#define DISPLAY_LIST
+
+// Have the compiler write out refreshScreenClean() one LED at a time from BOARD_ROWS and BOARD_COLS, so every port value
+// is a constant and there are no loops, table lookups or direction tests left. Dark LEDs cost a load and a branch, lit
+// ones a few more instructions and a call to ledDutyCycle(). That stays a call rather than inline, since 40 copies of it
+// wouldn't fit. Costs roughly 600 bytes of flash.
+
+//#define UNROLLED_REFRESH
+
+// Uncomment to save where we are in the video to EEPROM every RESUME_SAVE_SECONDS, and start one keyframe (or segment) on from
+// there at the next power up, instead of replaying the same opening on every battery swap. Needs a stream encoded with -k or -g.
+// EEPROM is only good for about 100,000 writes, so 300 seconds lasts about a year of continuous burning.
+
+//#define EEPROM_RESUME
+#define RESUME_SAVE_SECONDS 300
+
+// Check the battery every GOVERNOR_SAMPLE_SECONDS, and step down through dimmer tiers (and then skipping every other refresh)
+// as it runs down, so the candle fades out gently over its last hours rather than browning out. There's no ADC on this chip,
+// so the analog comparator checks the bandgap against half the supply, taken from between two LEDs in series from
+// GOVERNOR_DIVIDER_HIGH to PB1 (AIN1) to GOVERNOR_DIVIDER_LOW. That trips at about 2.2V. Each sample costs about 100us awake,
+// and it takes GOVERNOR_SAMPLES_DOWN low samples in a row to step down a tier. That is the only threshold, so the tiers just
+// step down every GOVERNOR_SAMPLES_DOWN samples for as long as the supply stays below it, and never come back up until a
+// fresh battery goes in, since a cell that reads high again once the load is lighter hasn't really recovered. Costs 6 bytes
+// of RAM.
+
+//#define GOVERNOR
+#define GOVERNOR_SAMPLE_SECONDS	4
+#define GOVERNOR_SAMPLES_DOWN	2
+#define GOVERNOR_DIVIDER_HIGH	_BV(0)		// Row 0 LED at col 3 goes from here to PB1
+#define GOVERNOR_DIVIDER_LOW	_BV(2)		// Row 3 LED at col 3 goes from PB1 to here
+
+// Check for daylight every LIGHT_SENSE_SAMPLE_SECONDS, and once it's bright leave the LEDs off and sleep for
+// LIGHT_SENSE_DAYLIGHT_WDTO at a time until it gets dark again. The video picks up where it left off. The sensor is an
+// LED on two spare PORTD pins, reverse biased so light drains its own capacitance, read after one 16ms sleep. It can't be
+// one of the matrix LEDs, since each of those has another LED wired the other way across the same two pins, and their
+// photocurrents cancel. It takes LIGHT_SENSE_SAMPLES samples in a row to switch either way. Costs 5 bytes of RAM and a few cycles per sample.
+
+//#define LIGHT_SENSE
+#define LIGHT_SENSE_SAMPLE_SECONDS	4
+#define LIGHT_SENSE_SAMPLES			2
+#define LIGHT_SENSE_DAYLIGHT_WDTO	WDTO_4S
+#define LIGHT_SENSE_ANODE			_BV(5)		// PD5
+#define LIGHT_SENSE_CATHODE			_BV(4)		// PD4
@@ -0,0 +1,2007 @@
+/*
+ * VideoEncoder.c
+ *
+ * Host side (Linux) encoder that turns a sequence of 5x8 brightness frames into the
+ * compressed videobitstream[] that nextFrame() in Candle0005.c plays back.
+ *
+ * Build with any normal gcc, this never goes near the AVR...
+ *
+ *		gcc -O2 -Wall -pthread -o VideoEncoder VideoEncoder.c -lm
+ *
+ * Encode a frames file into "Atmel Studio/VideoBitStream.c" and "Atmel Studio/VideoBitstream.h"...
+ *
+ *		./VideoEncoder -o "../Atmel Studio" flame.frames
+ *
+ * Decode the shipped stream back into a frames file (so we can edit it, or check a round trip)...
+ *
+ *		./VideoEncoder -d "../Atmel Studio/VideoBitStream.c" > flame.frames
+ *
+ * Squeeze a long clip into 2 KB, showing pixels a little off where that saves bits (per frame quality report on stdout)...
+ *
+ *		./VideoEncoder -b 2048 -o "../Atmel Studio" long.frames > report.txt
+ *
+ * Compare every format on some clips, one CSV line per clip and format (bench.sh does this for the whole corpus)...
+ *
+ *		./VideoEncoder -B -H flame.frames corpus/calm.frames corpus/gusty.frames
+ *
+ * Make a synthetic clip for the corpus (calm, gusty or dark)...
+ *
+ *		./VideoEncoder -S gusty -n 300 > corpus/gusty.frames
+ */
+
+/*
+	Frames file format
+	------------------
+
+	Plain text. Each frame is FDA_SIZE brightness values (0-31) separated by any whitespace.
+	Values are in the same order as fda[] - x goes left to right, y goes bottom to top - so
+	the first line of each frame is the bottom row of the candle. Anything after a '#' on a line
+	is a comment. The decoder writes one row per line and a blank line between frames.
+
+	Bitstream formats (as decoded by nextFrame())
+	---------------------------------------------
+
+	Bits are packed into bytes LSB first and run continuously across frame boundaries.
+	Each frame is coded against the one before it, last pixel (fda[FDA_SIZE-1]) first.
+	The decoder zeros fda[] before the first frame of each loop, so frame 0 is coded against an all-off frame.
+	Brightness values are always BRIGHTNESSBITS bits, MSB first. The format must match BITSTREAM_FORMAT in candle.h.
+
+	-f classic (BITSTREAM_CLASSIC)
+
+		0						pixel unchanged
+		1 bbbbb					pixel changes to brightness bbbbb
+
+	-f huffman (BITSTREAM_HUFFMAN)
+
+		0						pixel unchanged
+		1 hhh...				pixel changes, new brightness is a canonical Huffman code (1-8 bits, MSB first) built for this clip.
+								The code tables go into VideoBitStream.c as huffmanCodeCounts[] and huffmanSymbols[].
+
+	-f delta (BITSTREAM_DELTA)
+
+		0						pixel unchanged
+		1 0 s					pixel brightness goes up one step (s=0) or down one step (s=1)
+		1 1 0 m s				pixel brightness goes up or down 2+m steps
+		1 1 1 bbbbb				pixel changes to brightness bbbbb
+
+	-f spatial (BITSTREAM_SPATIAL)
+
+		Pixels are visited in the VIDEOBITSTREAM_SCAN_ORDER the encoder picked (or -s), and each changed pixel is
+		predicted to change by the same amount as the pixel visited just before it (0 if that one did not change).
+
+		0						pixel unchanged
+		1 0 s					pixel is the prediction +1 (s=0) or -1 (s=1)
+		1 1 0					pixel is exactly the prediction
+		1 1 1 0 m s				pixel is the prediction +/- 2+m
+		1 1 1 1 bbbbb			pixel changes to brightness bbbbb
+
+	-r and -H (any format, VIDEOBITSTREAM_FRAME_REFERENCES and VIDEOBITSTREAM_HOLDS)
+
+		Every frame starts with a header...
+
+		0 <frame>				a frame coded in the format above
+		1 oooo... nnnnnnnn		(-r) replay n frames starting at the normally coded frame whose header bit is at bit offset o
+								(VIDEOBITSTREAM_REF_OFFSET_BITS wide, MSB first), then carry on after this reference
+		1 hhhh					(-H) keep showing the previous frame for this frame and h more
+		1 0 ... / 1 1 ...		reference / hold, when both -r and -H are on
+
+	-g (any format, VIDEOBITSTREAM_SEGMENTS)
+
+		The clip is cut into segments. The first frame of each is a keyframe, coded as if every pixel changed (always
+		an absolute brightness), so it plays right after any other segment. videosegments[] has the bit offset of each
+		segment and videosegmentnext[] the segments that may follow it. References and holds never run past the end of a segment.
+
+	-k (any format, VIDEOBITSTREAM_KEYFRAMES)
+
+		Every VIDEOBITSTREAM_KEYFRAME_INTERVAL-th frame is a keyframe, coded the same way as a segment's first frame, and
+		videokeyframes[] has their bit offsets. References and holds never run past a keyframe.
+
+	-f classic-table (BITSTREAM_CLASSIC)
+
+		Exactly the same stream as classic. Pick this to get the decode cycle estimates for a TABLE_DECODE build.
+
+	-f rle (BITSTREAM_RLE)
+
+		r bbbbb					skip r unchanged pixels (Exp-Golomb order RLE_RUN_K, r may be 0), then the next pixel changes to bbbbb
+		r						skip r unchanged pixels up to the end of the frame (only when there are no more changed pixels)
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+
+typedef unsigned char byte;
+
+// These must match candle.h and Candle0005.c
+
+#define WIDTH 5
+#define HEIGHT 8
+#define FDA_SIZE (WIDTH*HEIGHT)
+
+#define BRIGHTNESSBITS 5
+#define BRIGHTNESS_LEVELS (1<<BRIGHTNESSBITS)
+
+#define FRAME_RATE 15				// Only for reporting
+
+#define MAX_FRAMES 10000
+#define MAX_STREAM_BYTES 65536
+
+static byte frames[MAX_FRAMES][FDA_SIZE];		// Brightness of each pixel in each frame
+static int frameCount;
+
+static int quiet;					// Set while searching so we only hear about the stream we keep
+
+#define REF_COUNT_BITS 8			// See "Frame references" below
+#define HOLD_BITS 4					// See "Holds" below
+
+static int frameRefs;				// -r
+static int refOffsetBits;			// Wide enough for any bit offset in the stream
+static int frameHolds;				// -H
+
+#define MAX_SEGMENTS 31				// So all the successor lists fit in a byte index
+#define MAX_NEXT 8					// Most segments allowed to follow any one segment
+#define SEGMENT_RECORD_SIZE 5		// Must match Candle0005.c
+#define UNKNOWN_BRIGHTNESS 0xFF		// Keyframes are coded against this so every pixel gets sent whatever was on the display
+
+static int segmentLength;			// -g, 0 for the plain loop
+static int segmentCount;
+static int segmentStart[MAX_SEGMENTS+1];			// First frame of each segment, [segmentCount] is frameCount
+static int segmentNext[MAX_SEGMENTS][MAX_NEXT];		// Which segments may follow each one
+static int segmentNextCount[MAX_SEGMENTS];
+static byte keyFrame[MAX_FRAMES];					// Coded so it does not depend on the frame before, so nextFrame() can start there
+static long keyFrameOffset[MAX_FRAMES];				// Bit offset of each keyframe in the stream, filled in by encodeStream()
+
+static int keyFrameInterval;		// -k, 0 for none
+
+// *** Bit packing
+
+typedef struct {
+	byte data[MAX_STREAM_BYTES];
+	long bits;						// Total bits written so far
+} bitstream;
+
+static void putBit( bitstream *s , int bit ) {
+	if (s->bits >= MAX_STREAM_BYTES*8L) {
+		fprintf( stderr , "Bitstream overflow - more than %d bytes\n" , MAX_STREAM_BYTES );
+		exit(1);
+	}
+	if (bit) s->data[s->bits/8] |= (byte) (1 << (s->bits%8));		// LSB first to match nextFrame()
+	s->bits++;
+}
+
+// Send the low (count) bits of (value) MSB first
+static void putBits( bitstream *s , unsigned value , int count ) {
+	while (count--) putBit( s , (value >> count) & 1 );
+}
+
+typedef struct {
+	const byte *data;
+	long len;						// in bytes
+	long pos;						// in bits
+} bitreader;
+
+// Returns -1 if we have run off the end of the data
+static int getBit( bitreader *r ) {
+	if (r->pos >= r->len*8) return -1;
+	int bit = (r->data[r->pos/8] >> (r->pos%8)) & 1;
+	r->pos++;
+	return bit;
+}
+
+static long readArray( const char *filename , const char *name , byte *data , long max );
+static const char *readHeaderDefine( const char *filename , const char *name );
+static void writeArray( FILE *f , const char *name , const byte *data , long len );
+
+// *** Codecs
+
+// Things the decoder has to do for a frame, so we can estimate what it costs on the AVR
+
+typedef struct {
+	long bits;						// Bits read from the stream (filled in by decodeStream())
+	long literals;					// Changed pixels written to fda[]
+	long tokens;					// Run lengths (or other multi-bit codes) parsed
+} decodestats;
+
+// Encode a single frame against the previous one
+typedef void (*encodefunc)( bitstream *s , const byte *prev , const byte *cur );
+
+// Decode a single frame on top of the previous one. Returns 0 if the data ran out before the frame was complete.
+typedef int (*decodefunc)( bitreader *r , byte *cur , decodestats *stats );
+
+typedef struct {
+	const char *name;				// For -f
+	const char *define;				// The matching BITSTREAM_FORMAT value in candle.h
+	encodefunc encode;
+	decodefunc decode;
+
+	// Optional, for codecs that need flash tables alongside videobitstream[]. NULL if not needed.
+
+	void (*prepare)( void );						// Build the tables from frames[] before encoding
+	long (*writeTables)( FILE *source , FILE *header );	// Add the tables to VideoBitStream.c and VideoBitstream.h, returns flash bytes used (source may be NULL to just count)
+	void (*readTables)( const char *filename );		// Load the tables back out of a VideoBitStream.c for -d
+
+	// Rough AVR cycle costs from reading the code that avr-gcc -Os makes of the matching nextFrame() loop. These are estimates, not measurements.
+
+	int cyclesPerBit;
+	int cyclesPerLiteral;
+	int cyclesPerToken;
+} codec;
+
+#define CYCLES_PER_BYTE 6			// LPM plus pointer increment and reloading workingBitsLeft
+
+static long estimateCycles( const codec *c , const decodestats *d ) {
+	return (d->bits * c->cyclesPerBit) + (d->bits/8 * CYCLES_PER_BYTE) + (d->literals * c->cyclesPerLiteral) + (d->tokens * c->cyclesPerToken);
+}
+
+// Read (count) bits MSB first into *value. Returns 0 if we ran out of data.
+static int getBits( bitreader *r , int count , int *value ) {
+	int v = 0;
+	while (count--) {
+		int bit = getBit( r );
+		if (bit<0) return 0;
+		v = (v<<1) | bit;
+	}
+	*value = v;
+	return 1;
+}
+
+// Classic - one flag bit per pixel
+
+static void encodeClassic( bitstream *s , const byte *prev , const byte *cur ) {
+	for( int i = FDA_SIZE-1 ; i >= 0 ; i-- ) {
+		if (cur[i]==prev[i]) {
+			putBit( s , 0 );
+		} else {
+			putBit( s , 1 );
+			putBits( s , cur[i] , BRIGHTNESSBITS );
+		}
+	}
+}
+
+static int decodeClassic( bitreader *r , byte *cur , decodestats *stats ) {
+	for( int i = FDA_SIZE-1 ; i >= 0 ; i-- ) {
+		int bit = getBit( r );
+		if (bit<0) return 0;
+		if (bit) {
+			int b;
+			if (!getBits( r , BRIGHTNESSBITS , &b )) return 0;
+			cur[i] = (byte) b;
+			stats->literals++;
+		}
+	}
+	return 1;
+}
+
+// Classic again, but costed the way the TABLE_DECODE decoder in Candle0005.c reads it - a run of 0 bits
+// (up to the end of the nibble, or the whole rest of the byte if it is all 0) or a whole brightness field per step
+
+static int decodeClassicTable( bitreader *r , byte *cur , decodestats *stats ) {
+	int i = FDA_SIZE;
+	while (i>0) {
+		if (r->pos >= r->len*8) return 0;
+		int bitsLeft = 8 - (r->pos%8);
+		int restOfByte = r->data[r->pos/8] >> (r->pos%8);
+		if (restOfByte & 1) {
+			int b;
+			getBit( r );
+			if (!getBits( r , BRIGHTNESSBITS , &b )) return 0;
+			cur[--i] = (byte) b;
+			stats->literals++;
+		} else {
+			int skip = 0;
+			if (restOfByte==0) {
+				skip = bitsLeft;
+			} else {
+				while ( !(restOfByte & (1<<skip)) && skip<4 ) skip++;
+			}
+			if (skip>i) skip = i;
+			r->pos += skip;
+			i -= skip;
+			stats->tokens++;
+		}
+	}
+	return 1;
+}
+
+// Huffman - classic flag bits, but changed pixels are sent as a canonical Huffman code built over this clip's brightness values.
+// The decoder walks huffmanCodeCounts[] (how many codes of each length) and huffmanSymbols[] (brightness values in code order).
+
+#define HUFFMAN_MAX_BITS 8			// So the decoder can keep the code in a byte
+
+static int huffmanLengths[BRIGHTNESS_LEVELS];		// Code length for each brightness, 0 if never used
+static unsigned huffmanCodes[BRIGHTNESS_LEVELS];
+static byte huffmanCounts[HUFFMAN_MAX_BITS+1];		// [n] = how many codes are n bits long
+static byte huffmanSymbols[BRIGHTNESS_LEVELS];		// Brightness values in canonical code order
+static int huffmanSymbolCount;
+static int huffmanMaxBits;
+
+// Assign canonical codes from huffmanLengths[], shortest first and then by brightness
+static void huffmanAssignCodes(void) {
+	memset( huffmanCounts , 0 , sizeof(huffmanCounts) );
+	huffmanSymbolCount = 0;
+	huffmanMaxBits = 0;
+
+	for( int len = 1 ; len <= HUFFMAN_MAX_BITS ; len++ ) {
+		for( int b = 0 ; b < BRIGHTNESS_LEVELS ; b++ ) {
+			if (huffmanLengths[b]==len) {
+				huffmanSymbols[huffmanSymbolCount++] = (byte) b;
+				huffmanCounts[len]++;
+				huffmanMaxBits = len;
+			}
+		}
+	}
+
+	unsigned code = 0;
+	int n = 0;
+
+	for( int len = 1 ; len <= huffmanMaxBits ; len++ ) {
+		for( int i = 0 ; i < huffmanCounts[len] ; i++ ) {
+			huffmanCodes[ huffmanSymbols[n++] ] = code++;
+		}
+		code <<= 1;
+	}
+}
+
+static void prepareHuffman(void) {
+	long freq[BRIGHTNESS_LEVELS] = {0};
+	byte prev[FDA_SIZE] = {0};
+
+	for( int n = 0 ; n < frameCount ; n++ ) {
+		if (keyFrame[n]) memset( prev , UNKNOWN_BRIGHTNESS , FDA_SIZE );
+		for( int i = 0 ; i < FDA_SIZE ; i++ ) {
+			if (frames[n][i]!=prev[i]) freq[ frames[n][i] ]++;
+		}
+		memcpy( prev , frames[n] , FDA_SIZE );
+	}
+
+	// Plain Huffman tree build. If the longest code comes out too long, flatten the frequencies and try again.
+
+	for(;;) {
+		long weight[BRIGHTNESS_LEVELS*2];
+		int parent[BRIGHTNESS_LEVELS*2];
+		int live[BRIGHTNESS_LEVELS*2];
+		int nodes = 0;
+		int used = 0;
+
+		for( int b = 0 ; b < BRIGHTNESS_LEVELS ; b++ ) {
+			weight[b] = freq[b];
+			parent[b] = -1;
+			live[b] = freq[b]>0;
+			used += live[b];
+		}
+		nodes = BRIGHTNESS_LEVELS;
+
+		memset( huffmanLengths , 0 , sizeof(huffmanLengths) );
+
+		if (used==1) {								// Degenerate clip with only one brightness - still needs a 1 bit code
+			for( int b = 0 ; b < BRIGHTNESS_LEVELS ; b++ ) if (live[b]) huffmanLengths[b] = 1;
+			break;
+		}
+
+		for( int merges = 0 ; merges < used-1 ; merges++ ) {
+			int lo1 = -1 , lo2 = -1;
+			for( int i = 0 ; i < nodes ; i++ ) {
+				if (!live[i]) continue;
+				if (lo1<0 || weight[i]<weight[lo1]) { lo2 = lo1; lo1 = i; }
+				else if (lo2<0 || weight[i]<weight[lo2]) lo2 = i;
+			}
+			weight[nodes] = weight[lo1] + weight[lo2];
+			parent[nodes] = -1;
+			live[nodes] = 1;
+			parent[lo1] = parent[lo2] = nodes;
+			live[lo1] = live[lo2] = 0;
+			nodes++;
+		}
+
+		int longest = 0;
+
+		for( int b = 0 ; b < BRIGHTNESS_LEVELS ; b++ ) {
+			if (!freq[b]) continue;
+			int len = 0;
+			for( int i = b ; parent[i] >= 0 ; i = parent[i] ) len++;
+			huffmanLengths[b] = len;
+			if (len>longest) longest = len;
+		}
+
+		if (longest <= HUFFMAN_MAX_BITS) break;
+
+		for( int b = 0 ; b < BRIGHTNESS_LEVELS ; b++ ) {
+			if (freq[b]) freq[b] = (freq[b]+1)/2;
+		}
+	}
+
+	huffmanAssignCodes();
+}
+
+static long writeHuffmanTables( FILE *source , FILE *header ) {
+	if (source) {
+		fprintf( source , "// Number of Huffman codes of each length, starting at 1 bit\n\n" );
+		writeArray( source , "huffmanCodeCounts" , huffmanCounts+1 , huffmanMaxBits );
+		fprintf( source , "// Brightness value for each Huffman code, in canonical code order\n\n" );
+		writeArray( source , "huffmanSymbols" , huffmanSymbols , huffmanSymbolCount );
+		fprintf( header , "extern byte PROGMEM const huffmanCodeCounts[];\n" );
+		fprintf( header , "extern byte PROGMEM const huffmanSymbols[];\n" );
+	}
+	return huffmanMaxBits + huffmanSymbolCount;
+}
+
+static void readHuffmanTables( const char *filename ) {
+	byte counts[HUFFMAN_MAX_BITS];
+	int maxBits = (int) readArray( filename , "huffmanCodeCounts" , counts , HUFFMAN_MAX_BITS );
+	int symbolCount = (int) readArray( filename , "huffmanSymbols" , huffmanSymbols , BRIGHTNESS_LEVELS );
+
+	memset( huffmanLengths , 0 , sizeof(huffmanLengths) );
+
+	int n = 0;
+	for( int len = 1 ; len <= maxBits ; len++ ) {
+		for( int i = 0 ; i < counts[len-1] && n < symbolCount ; i++ ) {
+			huffmanLengths[ huffmanSymbols[n++] & (BRIGHTNESS_LEVELS-1) ] = len;
+		}
+	}
+
+	huffmanAssignCodes();
+}
+
+static void encodeHuffman( bitstream *s , const byte *prev , const byte *cur ) {
+	for( int i = FDA_SIZE-1 ; i >= 0 ; i-- ) {
+		if (cur[i]==prev[i]) {
+			putBit( s , 0 );
+		} else {
+			putBit( s , 1 );
+			putBits( s , huffmanCodes[ cur[i] ] , huffmanLengths[ cur[i] ] );
+		}
+	}
+}
+
+// Same walk as nextFrame() does
+static int decodeHuffman( bitreader *r , byte *cur , decodestats *stats ) {
+	for( int i = FDA_SIZE-1 ; i >= 0 ; i-- ) {
+		int bit = getBit( r );
+		if (bit<0) return 0;
+		if (bit) {
+			unsigned code = 0 , first = 0;
+			int index = 0;
+			int len;
+			for( len = 1 ; len <= huffmanMaxBits ; len++ ) {
+				bit = getBit( r );
+				if (bit<0) return 0;
+				code |= (unsigned) bit;
+				stats->tokens++;
+				if (code - first < huffmanCounts[len]) break;
+				index += huffmanCounts[len];
+				first = (first + huffmanCounts[len]) << 1;
+				code <<= 1;
+			}
+			if (len > huffmanMaxBits) {
+				fprintf( stderr , "Bad Huffman code\n" );
+				return 0;
+			}
+			cur[i] = huffmanSymbols[ index + (int) (code - first) ];
+			stats->literals++;
+		}
+	}
+	return 1;
+}
+
+// Delta - classic flag bits, but a changed pixel is usually sent as a small step up or down from its old brightness
+
+static void encodeDelta( bitstream *s , const byte *prev , const byte *cur ) {
+	for( int i = FDA_SIZE-1 ; i >= 0 ; i-- ) {
+		int delta = cur[i] - prev[i];
+		int mag = delta<0 ? -delta : delta;
+
+		if (!delta) {
+			putBit( s , 0 );
+		} else if (mag==1) {
+			putBits( s , 0x2 , 2 );								// 1 0
+			putBit( s , delta<0 );
+		} else if (mag<=3) {
+			putBits( s , 0x6 , 3 );								// 1 1 0
+			putBit( s , mag-2 );
+			putBit( s , delta<0 );
+		} else {
+			putBits( s , 0x7 , 3 );								// 1 1 1
+			putBits( s , cur[i] , BRIGHTNESSBITS );
+		}
+	}
+}
+
+static int decodeDelta( bitreader *r , byte *cur , decodestats *stats ) {
+	for( int i = FDA_SIZE-1 ; i >= 0 ; i-- ) {
+		int bit = getBit( r );
+		if (bit<0) return 0;
+		if (!bit) continue;
+
+		int code;
+		if (!getBits( r , 1 , &code )) return 0;
+
+		int step = 1;
+
+		if (code) {
+			if (!getBits( r , 1 , &code )) return 0;
+			if (code) {
+				int b;
+				if (!getBits( r , BRIGHTNESSBITS , &b )) return 0;
+				cur[i] = (byte) b;
+				stats->literals++;
+				continue;
+			}
+			if (!getBits( r , 1 , &code )) return 0;
+			step = 2 + code;
+		}
+
+		if (!getBits( r , 1 , &code )) return 0;
+
+		int b = code ? cur[i]-step : cur[i]+step;
+
+		if (b<0 || b>=BRIGHTNESS_LEVELS) {
+			if (!quiet) fprintf( stderr , "Delta takes brightness out of range\n" );
+			return 0;
+		}
+
+		cur[i] = (byte) b;
+		stats->literals++;
+		stats->tokens++;
+	}
+	return 1;
+}
+
+// Spatial - classic flag bits, but a changed pixel is predicted to change by the same step as the pixel scanned just before it
+// (the one below it, in the default column order). Pixels are visited in one of the SCAN_xxx orders from candle.h.
+
+#define SCAN_ROWS		0			// These must match candle.h
+#define SCAN_COLUMNS	1
+#define SCAN_SERPENTINE	2
+
+static const char * const scanNames[] = { "rows" , "columns" , "serpentine" };
+static const char * const scanDefines[] = { "SCAN_ROWS" , "SCAN_COLUMNS" , "SCAN_SERPENTINE" };
+
+#define SCAN_COUNT 3
+
+static int forcedScan = -1;			// -s option, otherwise we try them all
+static int spatialScan;
+static byte scanOrder[FDA_SIZE];	// fda[] index of each step of the scan
+
+static void makeScanOrder( int scan ) {
+	int n = 0;
+	if (scan==SCAN_ROWS) {
+		for( int i = FDA_SIZE-1 ; i >= 0 ; i-- ) scanOrder[n++] = (byte) i;
+	} else {
+		for( int x = 0 ; x < WIDTH ; x++ ) {
+			for( int y = 0 ; y < HEIGHT ; y++ ) {
+				int yy = (scan==SCAN_SERPENTINE && (x&1)) ? HEIGHT-1-y : y;
+				scanOrder[n++] = (byte) ((yy*WIDTH)+x);
+			}
+		}
+	}
+	spatialScan = scan;
+}
+
+static void encodeSpatial( bitstream *s , const byte *prev , const byte *cur ) {
+	int lastStep = 0;				// How much the previous pixel in the scan changed by
+	for( int n = 0 ; n < FDA_SIZE ; n++ ) {
+		int i = scanOrder[n];
+		if (cur[i]==prev[i]) {
+			putBit( s , 0 );
+			lastStep = 0;
+			continue;
+		}
+
+		int residual = cur[i] - (prev[i] + lastStep);
+		int mag = residual<0 ? -residual : residual;
+
+		if (prev[i]==UNKNOWN_BRIGHTNESS) mag = BRIGHTNESS_LEVELS;		// Keyframe, so the prediction means nothing
+
+		putBit( s , 1 );
+
+		if (mag==1) {
+			putBit( s , 0 );									// 0 s
+			putBit( s , residual<0 );
+		} else if (mag==0) {
+			putBits( s , 0x2 , 2 );								// 1 0
+		} else if (mag<=3) {
+			putBits( s , 0x6 , 3 );								// 1 1 0 m s
+			putBit( s , mag-2 );
+			putBit( s , residual<0 );
+		} else {
+			putBits( s , 0x7 , 3 );								// 1 1 1 bbbbb
+			putBits( s , cur[i] , BRIGHTNESSBITS );
+		}
+
+		lastStep = cur[i] - prev[i];
+	}
+}
+
+static int decodeSpatial( bitreader *r , byte *cur , decodestats *stats ) {
+	int lastStep = 0;
+	for( int n = 0 ; n < FDA_SIZE ; n++ ) {
+		int i = scanOrder[n];
+		int bit = getBit( r );
+		if (bit<0) return 0;
+		if (!bit) {
+			lastStep = 0;
+			continue;
+		}
+
+		int b = cur[i] + lastStep;
+		int code;
+
+		if (!getBits( r , 1 , &code )) return 0;
+
+		if (!code) {
+			if (!getBits( r , 1 , &code )) return 0;
+			b += code ? -1 : 1;
+		} else {
+			if (!getBits( r , 1 , &code )) return 0;
+			if (code) {
+				if (!getBits( r , 1 , &code )) return 0;
+				if (code) {
+					if (!getBits( r , BRIGHTNESSBITS , &b )) return 0;
+				} else {
+					int m;
+					if (!getBits( r , 1 , &m ) || !getBits( r , 1 , &code )) return 0;
+					b += code ? -(2+m) : 2+m;
+				}
+			}
+			stats->tokens++;
+		}
+
+		if (b<0 || b>=BRIGHTNESS_LEVELS) {
+			if (!quiet) fprintf( stderr , "Prediction takes brightness out of range\n" );
+			return 0;
+		}
+
+		lastStep = b - cur[i];
+		cur[i] = (byte) b;
+		stats->literals++;
+	}
+	return 1;
+}
+
+// Pick the scan order that makes the smallest stream for this clip
+static void prepareSpatial(void) {
+	static bitstream trial;
+	long bestBits = -1;
+	int bestScan = 0;
+
+	for( int scan = 0 ; scan < SCAN_COUNT ; scan++ ) {
+		if (forcedScan>=0 && scan!=forcedScan) continue;
+
+		byte prev[FDA_SIZE] = {0};
+		memset( &trial , 0 , sizeof(trial) );
+		makeScanOrder( scan );
+
+		for( int n = 0 ; n < frameCount ; n++ ) {
+			if (keyFrame[n]) memset( prev , UNKNOWN_BRIGHTNESS , FDA_SIZE );
+			encodeSpatial( &trial , prev , frames[n] );
+			memcpy( prev , frames[n] , FDA_SIZE );
+		}
+
+		if (!quiet) fprintf( stderr , "  spatial scan %-10s %ld bits\n" , scanNames[scan] , trial.bits );
+
+		if (bestBits<0 || trial.bits<bestBits) {
+			bestBits = trial.bits;
+			bestScan = scan;
+		}
+	}
+
+	makeScanOrder( bestScan );
+}
+
+static long writeSpatialTables( FILE *source , FILE *header ) {
+	(void) source;
+	if (header) fprintf( header , "\n#define\tVIDEOBITSTREAM_SCAN_ORDER\t%s\n" , scanDefines[spatialScan] );
+	return 0;
+}
+
+// The scan order is in the VideoBitstream.h next to the VideoBitStream.c, unless -s said otherwise
+static void readSpatialTables( const char *filename ) {
+	if (forcedScan>=0) {
+		makeScanOrder( forcedScan );
+		return;
+	}
+
+	const char *value = readHeaderDefine( filename , "VIDEOBITSTREAM_SCAN_ORDER" );
+
+	for( int i = 0 ; value && i < SCAN_COUNT ; i++ ) {
+		if (!strcmp( value , scanDefines[i] )) {
+			makeScanOrder( i );
+			return;
+		}
+	}
+
+	fprintf( stderr , "No VIDEOBITSTREAM_SCAN_ORDER in the VideoBitstream.h next to %s, use -s\n" , filename );
+	exit(1);
+}
+
+// RLE - Exp-Golomb coded runs of unchanged pixels, each implicitly followed by a changed pixel
+
+#define RLE_RUN_K 1			// Must match RLE_RUN_K in Candle0005.c
+
+static void putExpGolomb( bitstream *s , unsigned value , int k ) {
+	unsigned x = value + (1u<<k);
+	int len = 0;
+	while ( (x>>len) > 1 ) len++;		// len = index of the top bit of x
+	putBits( s , 0 , len-k );
+	putBits( s , x , len+1 );
+}
+
+static int getExpGolomb( bitreader *r , int k , int *value , decodestats *stats ) {
+	int zeros = 0;
+	int bit;
+	while ( (bit=getBit( r )) == 0 ) zeros++;
+	if (bit<0) return 0;
+	int rest;
+	if (!getBits( r , zeros+k , &rest )) return 0;
+	*value = ((1<<(zeros+k)) | rest) - (1<<k);
+	stats->tokens++;
+	return 1;
+}
+
+static void encodeRLE( bitstream *s , const byte *prev , const byte *cur ) {
+	int run = 0;
+	for( int i = FDA_SIZE-1 ; i >= 0 ; i-- ) {
+		if (cur[i]==prev[i]) {
+			run++;
+		} else {
+			putExpGolomb( s , run , RLE_RUN_K );
+			putBits( s , cur[i] , BRIGHTNESSBITS );
+			run = 0;
+		}
+	}
+	if (run) putExpGolomb( s , run , RLE_RUN_K );
+}
+
+static int decodeRLE( bitreader *r , byte *cur , decodestats *stats ) {
+	int i = FDA_SIZE;
+	while (i>0) {
+		int run;
+		if (!getExpGolomb( r , RLE_RUN_K , &run , stats )) return 0;
+		if (run>i) {
+			fprintf( stderr , "Bad run length %d with only %d pixels left in frame\n" , run , i );
+			return 0;
+		}
+		i -= run;
+		if (i>0) {
+			int b;
+			if (!getBits( r , BRIGHTNESSBITS , &b )) return 0;
+			cur[--i] = (byte) b;
+			stats->literals++;
+		}
+	}
+	return 1;
+}
+
+static const codec codecs[] = {
+	// name           , define              , encode        , decode             , prepare        , writeTables        , readTables        , bit , literal , token
+	{ "classic"       , "BITSTREAM_CLASSIC" , encodeClassic , decodeClassic      , NULL           , NULL               , NULL              , 14  ,  9 ,  0 },
+	{ "classic-table" , "BITSTREAM_CLASSIC" , encodeClassic , decodeClassicTable , NULL           , NULL               , NULL              ,  1  , 30 , 18 },		// Same stream as classic, for TABLE_DECODE builds
+	{ "rle"           , "BITSTREAM_RLE"     , encodeRLE     , decodeRLE          , NULL           , NULL               , NULL              , 10  ,  9 , 12 },
+	{ "huffman"       , "BITSTREAM_HUFFMAN" , encodeHuffman , decodeHuffman      , prepareHuffman , writeHuffmanTables , readHuffmanTables , 14  , 12 , 10 },
+	{ "delta"         , "BITSTREAM_DELTA"   , encodeDelta   , decodeDelta        , NULL           , NULL               , NULL              , 14  , 12 ,  6 },
+	{ "spatial"       , "BITSTREAM_SPATIAL" , encodeSpatial , decodeSpatial      , prepareSpatial , writeSpatialTables , readSpatialTables , 16  , 16 ,  6 },
+};
+
+#define CODEC_COUNT ((int) (sizeof(codecs)/sizeof(codecs[0])))
+
+static const codec *findCodec( const char *name ) {
+	for( int i = 0 ; i < CODEC_COUNT ; i++ ) {
+		if (!strcmp( codecs[i].name , name )) return &codecs[i];
+	}
+	fprintf( stderr , "Unknown format '%s'. Formats are:" , name );
+	for( int i = 0 ; i < CODEC_COUNT ; i++ ) fprintf( stderr , " %s" , codecs[i].name );
+	fprintf( stderr , "\n" );
+	exit(1);
+}
+
+// *** Input
+
+static void readFrames( const char *filename ) {
+	FILE *f = fopen( filename , "r" );
+	if (!f) {
+		perror( filename );
+		exit(1);
+	}
+
+	int pixel = 0;
+	int line = 1;
+	int c;
+
+	while ( (c=fgetc(f)) != EOF ) {
+		if (c=='#') {
+			while ( c!='\n' && c!=EOF ) c=fgetc(f);
+		}
+		if (c=='\n') line++;
+		if (c>='0' && c<='9') {
+			ungetc( c , f );
+			int b;
+			if (fscanf( f , "%d" , &b ) != 1 || b >= BRIGHTNESS_LEVELS ) {
+				fprintf( stderr , "%s:%d: brightness must be 0-%d\n" , filename , line , BRIGHTNESS_LEVELS-1 );
+				exit(1);
+			}
+			if (frameCount==MAX_FRAMES) {
+				fprintf( stderr , "%s:%d: too many frames (max %d)\n" , filename , line , MAX_FRAMES );
+				exit(1);
+			}
+			frames[frameCount][pixel++] = (byte) b;
+			if (pixel==FDA_SIZE) {
+				pixel = 0;
+				frameCount++;
+			}
+		} else if ( c!=EOF && c!='\n' && c!=' ' && c!='\t' && c!='\r' ) {
+			fprintf( stderr , "%s:%d: unexpected character '%c'\n" , filename , line , c );
+			exit(1);
+		}
+	}
+
+	fclose(f);
+
+	if (pixel) {
+		fprintf( stderr , "%s: last frame is incomplete (%d of %d pixels)\n" , filename , pixel , FDA_SIZE );
+		exit(1);
+	}
+	if (!frameCount) {
+		fprintf( stderr , "%s: no frames\n" , filename );
+		exit(1);
+	}
+}
+
+// Pull the hex bytes out of the initializer of array (name) in a generated VideoBitStream.c
+static long readArray( const char *filename , const char *name , byte *data , long max ) {
+	FILE *f = fopen( filename , "r" );
+	if (!f) {
+		perror( filename );
+		exit(1);
+	}
+
+	char line[1024];
+	char decl[256];
+	int found = 0;
+
+	snprintf( decl , sizeof(decl) , " %s[]" , name );
+
+	while ( !found && fgets( line , sizeof(line) , f ) ) {
+		if (strstr( line , decl ) && strchr( line , '{' )) found = 1;
+	}
+
+	if (!found) {
+		fprintf( stderr , "%s: could not find %s[]\n" , filename , name );
+		exit(1);
+	}
+
+	long len = 0;
+	int c;
+	unsigned v;
+
+	while ( (c=fgetc(f)) != EOF && c!='}' ) {
+		if (c=='0') {
+			if (fscanf( f , "x%x" , &v ) == 1 ) {
+				if (len==max) {
+					fprintf( stderr , "%s: %s[] too long\n" , filename , name );
+					exit(1);
+				}
+				data[len++] = (byte) v;
+			}
+		}
+	}
+
+	fclose(f);
+
+	return len;
+}
+
+// Get the value of #define (name) from the VideoBitstream.h that goes with the VideoBitStream.c (filename). NULL if it is not there.
+static const char *readHeaderDefine( const char *filename , const char *name ) {
+	static char value[256];
+	char path[4096];
+	char line[1024];
+
+	snprintf( path , sizeof(path) , "%s" , filename );
+	char *slash = strrchr( path , '/' );
+	char *base = slash ? slash+1 : path;
+	snprintf( base , sizeof(path) - (size_t) (base-path) , "VideoBitstream.h" );
+
+	FILE *f = fopen( path , "r" );
+	if (!f) {
+		perror( path );
+		exit(1);
+	}
+
+	const char *found = NULL;
+	char define[256];
+
+	while ( !found && fgets( line , sizeof(line) , f ) ) {
+		value[0] = 0;
+		if ( sscanf( line , " #define %255s %255s" , define , value ) >= 1 && !strcmp( define , name ) ) found = value;		// Value is "" for a plain #define
+	}
+
+	fclose(f);
+
+	return found;
+}
+
+// *** Lossy
+//
+// With -e or -b we do not have to show every frame exactly. frames[] gets replaced by what we will actually show, which is
+// then encoded losslessly as usual. Error is measured as the difference in CIE lightness (0-100) of the light that comes out
+// after brightness2Dutycycle[], so it means the same thing at the dim and bright ends. One brightness step is about 3.
+
+static const byte brightness2Dutycycle[BRIGHTNESS_LEVELS] = {		// Must match Candle0005.c (with FULL_ON_DUTYCYCLE 255)
+	0,     1 ,     2,     3,     4,     5,     7,     9,    12,
+	15,    18,    22,    27,    32,    38,    44,    51,    58,
+	67,    76,    86,    96,   108,   120,   134,   148,   163,
+	180,   197,   216,   235,   255,
+};
+
+static byte sourceFrames[MAX_FRAMES][FDA_SIZE];		// The frames we were asked for
+// With -D the firmware is built with DITHER, and the bottom 16 levels are dithered down to the quarter cycle. The frames we
+// are given still use the levels in brightness2Dutycycle[], so every pixel gets moved to a dithered level that looks like it.
+
+static const double ditheredDutycycle[BRIGHTNESS_LEVELS] = {		// Must match ditherQuarters[] and brightness2Dutycycle[] in Candle0005.c
+	0,   0.5,     1,   1.5,     2,   2.5,     3,   3.5,
+	4.25,  5,     6,     7,   8.5,    10,    12,  14.5,
+	17,   20,    24,    29,    35,    42,    50,    60,
+	72,   86,   103,   124,   148,   177,   213,   255,
+};
+
+static double lightnessError[BRIGHTNESS_LEVELS][BRIGHTNESS_LEVELS];
+static int lossy;
+static double shownError;			// How far off quantizeFrames() let frames[] get, so frame references can be that far off too
+static int dither;
+
+static double lightness( double dutyCycle ) {
+	double y = dutyCycle / 255.0;
+	return (y > 216.0/24389) ? (116*cbrt(y)) - 16 : y * (24389.0/27);
+}
+
+// lightnessError[shown][want] is how far brightness (shown) on the display looks from brightness (want) in a source frame
+static void makeLightnessErrors(void) {
+	for( int shown = 0 ; shown < BRIGHTNESS_LEVELS ; shown++ ) {
+		double shownLightness = lightness( dither ? ditheredDutycycle[shown] : brightness2Dutycycle[shown] );
+
+		for( int want = 0 ; want < BRIGHTNESS_LEVELS ; want++ ) {
+			lightnessError[shown][want] = fabs( shownLightness - lightness( brightness2Dutycycle[want] ) );
+		}
+	}
+}
+
+// With -D, check that every pixel looks no further off than the next brightness up or down would in a build without DITHER
+// (or than -e allows), and that nothing went dark that -e would have kept lit without DITHER
+static void checkDithered( double maxError ) {
+	for( int n = 0 ; n < frameCount ; n++ ) {
+		for( int i = 0 ; i < FDA_SIZE ; i++ ) {
+			int want = sourceFrames[n][i];
+			double wantLightness = lightness( brightness2Dutycycle[want] );
+			double step = 0;
+
+			if (want > 0) step = fmax( step , wantLightness - lightness( brightness2Dutycycle[want-1] ) );
+			if (want < BRIGHTNESS_LEVELS-1) step = fmax( step , lightness( brightness2Dutycycle[want+1] ) - wantLightness );
+
+			if ( lightnessError[ frames[n][i] ][want] > fmax( step , maxError ) || (!frames[n][i] && wantLightness > maxError) ) {
+				fprintf( stderr , "Internal error: frame %d pixel %d is brightness %d, which does not look like %d\n" , n , i , frames[n][i] , want );
+				exit(1);
+			}
+		}
+	}
+}
+
+typedef struct {
+	int firstPixel;
+	int pixelStep;
+	double maxError;
+} quantizejob;
+
+// Each pixel only depends on its own history, so threads can take a share of the pixels each. A pixel keeps its old
+// brightness while that is close enough. When it has to change, it goes to whichever close enough brightness will stay
+// close enough for the most frames to come, so it changes as few times as possible.
+static void *quantizePixels( void *arg ) {
+	const quantizejob *job = arg;
+
+	for( int i = job->firstPixel ; i < FDA_SIZE ; i += job->pixelStep ) {
+		int shown = 0;					// nextFrame() starts from a blank display
+
+		for( int n = 0 ; n < frameCount ; n++ ) {
+			int want = sourceFrames[n][i];
+
+			if (lightnessError[shown][want] > job->maxError) {
+				int bestRun = -1;
+				for( int b = 0 ; b < BRIGHTNESS_LEVELS ; b++ ) {
+					if (lightnessError[b][want] > job->maxError) continue;
+					int run = 1;
+					while ( n+run < frameCount && lightnessError[b][ sourceFrames[n+run][i] ] <= job->maxError ) run++;
+					if ( run > bestRun || (run==bestRun && lightnessError[b][want] < lightnessError[shown][want]) ) {
+						bestRun = run;
+						shown = b;
+					}
+				}
+
+				if (bestRun<0) {			// Only with -D, where a level may have nothing that close, so take the nearest
+					for( int b = 0 ; b < BRIGHTNESS_LEVELS ; b++ ) {
+						if (lightnessError[b][want] < lightnessError[shown][want]) shown = b;
+					}
+				}
+			}
+
+			frames[n][i] = (byte) shown;
+		}
+	}
+
+	return NULL;
+}
+
+// Fill frames[] with the closest thing to sourceFrames[] that never looks more than (maxError) off, using every core
+static void quantizeFrames( double maxError ) {
+	shownError = maxError;
+	long cores = sysconf( _SC_NPROCESSORS_ONLN );
+	int threadCount = (cores < 1) ? 1 : (cores > FDA_SIZE) ? FDA_SIZE : (int) cores;
+	pthread_t threads[FDA_SIZE];
+	quantizejob jobs[FDA_SIZE];
+
+	for( int t = 0 ; t < threadCount ; t++ ) {
+		jobs[t].firstPixel = t;
+		jobs[t].pixelStep = threadCount;
+		jobs[t].maxError = maxError;
+		if (pthread_create( &threads[t] , NULL , quantizePixels , &jobs[t] )) {
+			fprintf( stderr , "Could not start a thread\n" );
+			exit(1);
+		}
+	}
+
+	for( int t = 0 ; t < threadCount ; t++ ) pthread_join( threads[t] , NULL );
+
+	if (dither) checkDithered( maxError );
+}
+
+// How far frame (n) as shown is from what was asked for
+static void frameError( int n , double *maxError , double *meanError ) {
+	*maxError = 0;
+	*meanError = 0;
+	for( int i = 0 ; i < FDA_SIZE ; i++ ) {
+		double e = lightnessError[ frames[n][i] ][ sourceFrames[n][i] ];
+		if (e > *maxError) *maxError = e;
+		*meanError += e / FDA_SIZE;
+	}
+}
+
+// *** Keyframes
+
+// With -k there is a keyframe every keyFrameInterval frames, and videokeyframes[] has the bit offset of each (frame 0
+// included, which needs no keyframe since the loop always starts from a blank display). nextFrame() can start playing
+// at any of them without decoding what comes before, which is how it resumes after a power cycle.
+
+static void markKeyFrames(void) {
+	memset( keyFrame , 0 , sizeof(keyFrame) );
+	for( int n = keyFrameInterval ; n < frameCount ; n += keyFrameInterval ) keyFrame[n] = 1;
+}
+
+// Index for nextFrame(). Returns flash bytes used (source may be NULL to just count).
+static long writeKeyFrameTables( FILE *source , FILE *header ) {
+	byte offsets[ ((MAX_FRAMES/2)+1) * 2 ];
+	int count = 0;
+
+	for( int n = 0 ; n < frameCount ; n += keyFrameInterval ) {
+		long offset = n ? keyFrameOffset[n] : 0;
+		offsets[count*2] = (byte) (offset & 0xff);
+		offsets[(count*2)+1] = (byte) (offset >> 8);
+		count++;
+	}
+
+	if (source) {
+		fprintf( source , "// Bit offset of every VIDEOBITSTREAM_KEYFRAME_INTERVAL-th frame, low byte first\n\n" );
+		writeArray( source , "videokeyframes" , offsets , count*2 );
+		fprintf( header , "\n#define\tVIDEOBITSTREAM_KEYFRAMES\n" );
+		fprintf( header , "#define\tVIDEOBITSTREAM_KEYFRAME_INTERVAL\t%d\n" , keyFrameInterval );
+		fprintf( header , "#define\tVIDEOBITSTREAM_KEYFRAME_COUNT\t%d\n" , count );
+		fprintf( header , "extern byte PROGMEM const videokeyframes[];\n" );
+	}
+
+	return count*2;
+}
+
+// *** Segments
+
+// With -g the clip is cut into segments of about segmentLength frames, and each segment gets a list of the segments that
+// may follow it. At the end of each segment nextFrame() picks one of them with an LFSR, so the flame never settles into
+// a loop you can spot. The first frame of each segment is a keyframe so it comes out right whatever was playing before.
+
+#define SEGMENT_LFSR_PERIOD 65535L	// 16 bit maximal length LFSR in nextFrame()
+
+static int frameDistance( const byte *a , const byte *b ) {
+	int d = 0;
+	for( int i = 0 ; i < FDA_SIZE ; i++ ) d += abs( a[i] - b[i] );
+	return d;
+}
+
+// How big a jump it is from the end of segment (a) into segment (b). What matters is how much the last frame of (a)
+// looks like the frame that (b) normally follows. Segment 0 normally follows the last frame, same as the plain loop.
+static int joinDistance( int a , int b ) {
+	int before = b ? segmentStart[b]-1 : frameCount-1;
+	return frameDistance( frames[ segmentStart[a+1]-1 ] , frames[before] );
+}
+
+// Cut the clip about every segmentLength frames, each time just after the frame in the window that looks most like (pivot)
+static void cutSegments( const byte *pivot ) {
+	int cut = 0;
+
+	segmentCount = 1;
+	segmentStart[0] = 0;
+
+	while ( cut + (segmentLength*3)/2 < frameCount && segmentCount < MAX_SEGMENTS ) {
+		int best = cut + segmentLength/2;
+		for( int c = best+1 ; c < cut + (segmentLength*3)/2 ; c++ ) {
+			if (frameDistance( frames[c-1] , pivot ) < frameDistance( frames[best-1] , pivot )) best = c;
+		}
+		segmentStart[segmentCount++] = cut = best;
+	}
+
+	segmentStart[segmentCount] = frameCount;
+}
+
+// Let each segment go on to the one after it, plus the closest others that join within (threshold). Returns how many joins in all.
+static int linkSegments( int threshold ) {
+	int links = 0;
+
+	for( int a = 0 ; a < segmentCount ; a++ ) {
+		int natural = (a+1) % segmentCount;
+		int n = 0;
+
+		segmentNext[a][n++] = natural;
+
+		while ( n < MAX_NEXT ) {
+			int best = -1;
+			for( int b = 0 ; b < segmentCount ; b++ ) {
+				int used = 0;
+				for( int i = 0 ; i < n ; i++ ) used |= segmentNext[a][i]==b;
+				if ( used || joinDistance( a , b ) > threshold ) continue;
+				if ( best<0 || joinDistance( a , b ) < joinDistance( a , best ) ) best = b;
+			}
+			if (best<0) break;
+			segmentNext[a][n++] = best;
+		}
+
+		segmentNextCount[a] = n;
+		links += n;
+	}
+
+	return links;
+}
+
+static int compareInts( const void *a , const void *b ) {
+	return *(const int *) a - *(const int *) b;
+}
+
+// Try cutting next to each of a couple of hundred frames and keep whichever gives the most joins
+static void findSegments(void) {
+	static int steps[MAX_FRAMES];
+	int threshold = 0;
+
+	if (frameCount>1) {				// A join may cost as much as the 1 in 10 biggest frame to frame steps in the clip
+		for( int n = 0 ; n < frameCount-1 ; n++ ) steps[n] = frameDistance( frames[n] , frames[n+1] );
+		qsort( steps , (size_t) frameCount-1 , sizeof(steps[0]) , compareInts );
+		threshold = steps[ ((frameCount-1)*9)/10 ];
+	}
+
+	int bestPivot = 0 , bestLinks = -1;
+
+	memset( keyFrame , 0 , sizeof(keyFrame) );
+
+	for( int p = 0 ; p < frameCount ; p += (frameCount+199)/200 ) {
+		cutSegments( frames[p] );
+		int links = linkSegments( threshold );
+		if (links>bestLinks) {
+			bestLinks = links;
+			bestPivot = p;
+		}
+	}
+
+	cutSegments( frames[bestPivot] );
+	linkSegments( threshold );
+
+	for( int a = 0 ; a < segmentCount ; a++ ) {
+		if (segmentStart[a+1]-segmentStart[a] > 255) {
+			fprintf( stderr , "Segment %d is %d frames, more than the 255 nextFrame() can count. Use a bigger -g.\n" , a , segmentStart[a+1]-segmentStart[a] );
+			exit(1);
+		}
+		keyFrame[ segmentStart[a] ] = 1;
+	}
+
+	double meanLength = (double) frameCount / segmentCount;
+
+	if (quiet) return;
+
+	fprintf( stderr , "  %d segments of about %.0f frames with %d ways to join them (join threshold %d)\n" , segmentCount , meanLength , bestLinks , threshold );
+	fprintf( stderr , "  segment choices only come round again after %ld segments, about %.0f hours\n" , SEGMENT_LFSR_PERIOD , SEGMENT_LFSR_PERIOD * meanLength / FRAME_RATE / 3600 );
+}
+
+// Segment table for nextFrame(). Returns flash bytes used (source may be NULL to just count).
+static long writeSegmentTables( FILE *source , FILE *header ) {
+	byte records[MAX_SEGMENTS*SEGMENT_RECORD_SIZE];
+	byte next[MAX_SEGMENTS*MAX_NEXT];
+	int links = 0;
+
+	for( int a = 0 ; a < segmentCount ; a++ ) {
+		byte *r = records + (a*SEGMENT_RECORD_SIZE);
+		r[0] = (byte) (keyFrameOffset[ segmentStart[a] ] & 0xff);
+		r[1] = (byte) (keyFrameOffset[ segmentStart[a] ] >> 8);
+		r[2] = (byte) (segmentStart[a+1]-segmentStart[a]);
+		r[3] = (byte) links;
+		r[4] = (byte) segmentNextCount[a];
+		for( int i = 0 ; i < segmentNextCount[a] ; i++ ) next[links++] = (byte) segmentNext[a][i];
+	}
+
+	if (source) {
+		fprintf( source , "// For each segment: bit offset (low byte first), frame count, index of its first successor in videosegmentnext[], successor count\n\n" );
+		writeArray( source , "videosegments" , records , segmentCount*SEGMENT_RECORD_SIZE );
+		fprintf( source , "// Segments that may follow each segment\n\n" );
+		writeArray( source , "videosegmentnext" , next , links );
+		fprintf( header , "\n#define\tVIDEOBITSTREAM_SEGMENTS\n" );
+		fprintf( header , "#define\tVIDEOBITSTREAM_SEGMENT_COUNT\t%d\n" , segmentCount );
+		fprintf( header , "extern byte PROGMEM const videosegments[];\n" );
+		fprintf( header , "extern byte PROGMEM const videosegmentnext[];\n" );
+	}
+
+	return (segmentCount*SEGMENT_RECORD_SIZE) + links;
+}
+
+// *** Synthetic clips
+
+// A flame that is a blob of light sitting on the bottom row, whose height, sideways position and brightness wander
+// about. How far they wander each frame is what makes it calm or gusty. Same clip every time for the same kind and count.
+
+typedef struct {
+	const char *name;
+	double peak;					// Brightest it gets, 0-31
+	double heightWander;			// How far the top can move in one frame, in rows
+	double centerWander;			// How far it can lean in one frame, in columns
+	double peakWander;				// How much the brightness can change in one frame
+} clipkind;
+
+static const clipkind clipKinds[] = {
+	{ "calm"  , 31 , 0.15 , 0.05 , 0.3 },
+	{ "gusty" , 31 , 1.20 , 0.45 , 3.0 },
+	{ "dark"  , 9  , 0.30 , 0.10 , 0.5 },
+};
+
+#define CLIP_KIND_COUNT ((int) (sizeof(clipKinds)/sizeof(clipKinds[0])))
+
+static unsigned clipRandomState = 2463534242u;
+
+// xorshift, so the clips do not depend on which C library made them. Returns -1 to 1.
+static double clipRandom(void) {
+	clipRandomState ^= clipRandomState << 13;
+	clipRandomState ^= clipRandomState >> 17;
+	clipRandomState ^= clipRandomState << 5;
+	return ( (clipRandomState % 20001) / 10000.0 ) - 1;
+}
+
+static double clamp( double v , double lo , double hi ) {
+	return v<lo ? lo : v>hi ? hi : v;
+}
+
+static void generateClip( const char *name , int count ) {
+	const clipkind *k = NULL;
+
+	for( int i = 0 ; i < CLIP_KIND_COUNT ; i++ ) if (!strcmp( clipKinds[i].name , name )) k = &clipKinds[i];
+
+	if (!k) {
+		fprintf( stderr , "Unknown clip kind '%s'. Kinds are:" , name );
+		for( int i = 0 ; i < CLIP_KIND_COUNT ; i++ ) fprintf( stderr , " %s" , clipKinds[i].name );
+		fprintf( stderr , "\n" );
+		exit(1);
+	}
+
+	if (count<1 || count>MAX_FRAMES) count = 300;
+
+	double height = HEIGHT-2 , center = (WIDTH-1)/2.0 , peak = k->peak;
+
+	for( int n = 0 ; n < count ; n++ ) {
+		height = clamp( height + (clipRandom() * k->heightWander) , 3 , HEIGHT+1 );
+		center = clamp( center + (clipRandom() * k->centerWander) , 1.2 , WIDTH-2.2 );
+		peak = clamp( peak + (clipRandom() * k->peakWander) , k->peak*0.6 , k->peak );
+
+		for( int y = 0 ; y < HEIGHT ; y++ ) {
+			for( int x = 0 ; x < WIDTH ; x++ ) {
+				double across = (x-center) / 0.8;
+				double up = (y < height) ? sin( M_PI * (y+1) / (height+1) ) : 0;
+				double b = peak * up * exp( -across*across/2 );
+				frames[n][(y*WIDTH)+x] = (byte) clamp( b+0.5 , 0 , BRIGHTNESS_LEVELS-1 );
+			}
+		}
+	}
+
+	frameCount = count;
+}
+
+// *** Output
+
+static FILE *openOutput( const char *dir , const char *name ) {
+	char path[4096];
+	snprintf( path , sizeof(path) , "%s/%s" , dir , name );
+	FILE *f = fopen( path , "w" );
+	if (!f) {
+		perror( path );
+		exit(1);
+	}
+	return f;
+}
+
+// Write a PROGMEM byte array initializer, 10 to a line
+static void writeArray( FILE *f , const char *name , const byte *data , long len ) {
+	fprintf( f , "byte PROGMEM const %s[]  = {\n" , name );
+	for( long i = 0 ; i < len ; i++ ) {
+		if (i%10==0) fprintf( f , "\t" );
+		fprintf( f , "0x%02x," , data[i] );
+		if (i%10==9 || i==len-1) fprintf( f , "\n" );
+	}
+	fprintf( f , "};\n\n" );
+}
+
+static void writeSource( const char *dir , const bitstream *s , const codec *c ) {
+	FILE *source = openOutput( dir , "VideoBitStream.c" );
+	FILE *header = openOutput( dir , "VideoBitstream.h" );
+	FILE *f = source;
+
+	fprintf( f , "/*\n * VideoBitStream.c\n *\n * Generated by VideoEncoder - do not edit by hand, edit the frames and re-encode.\n */ \n\n" );
+	fprintf( f , "// Holds the actual compressed video bitstream data.\n" );
+	fprintf( f , "// this is stored in program memory flash and must be accessed with\n" );
+	fprintf( f , "// the pgm_read_byte() functions.\n\n\n" );
+	fprintf( f , "#include <avr/pgmspace.h>\n\n#include \"candle.h\"\n\n#include \"VideoBitstream.h\"\n\n" );
+	writeArray( f , "videobitstream" , s->data , (s->bits+7)/8 );
+
+	f = header;
+	fprintf( f , "// Generated by VideoEncoder along with VideoBitStream.c - do not edit by hand\n\n" );
+	fprintf( f , "#define\tFRAMECOUNT\t((framecounttype) %d)\n\n" , frameCount );
+	if (frameCount>255) {
+		fprintf( f , "// Fails to compile if framecounttype in candle.h is still a byte\n" );
+		fprintf( f , "typedef char framecounttype_is_too_small[ (FRAMECOUNT==%d) ? 1 : -1 ];\n\n" , frameCount );
+	}
+	fprintf( f , "#define\tVIDEOBITSTREAM_FORMAT\t%s\n\n" , c->define );
+
+	int maxBrightness = 0;			// So the firmware knows if every duty cycle this clip uses fits in a byte
+	for( int n = 0 ; n < frameCount ; n++ ) {
+		for( int i = 0 ; i < FDA_SIZE ; i++ ) {
+			if (frames[n][i] > maxBrightness) maxBrightness = frames[n][i];
+		}
+	}
+	fprintf( f , "#define\tVIDEOBITSTREAM_MAX_BRIGHTNESS\t%d\n\n" , maxBrightness );
+
+	if (dither) fprintf( f , "#define\tVIDEOBITSTREAM_DITHER\n\n" );			// Levels are the dithered ones, so the firmware needs DITHER
+	fprintf( f , "extern byte PROGMEM const videobitstream[];\n" );
+
+	if (frameHolds) {
+		fprintf( f , "\n#define\tVIDEOBITSTREAM_HOLDS\n" );
+		fprintf( f , "#define\tVIDEOBITSTREAM_HOLD_BITS\t%d\n" , HOLD_BITS );
+	}
+
+	if (frameRefs) {
+		fprintf( f , "\n#define\tVIDEOBITSTREAM_FRAME_REFERENCES\n" );
+		fprintf( f , "#define\tVIDEOBITSTREAM_REF_OFFSET_BITS\t%d\n" , refOffsetBits );
+		fprintf( f , "#define\tVIDEOBITSTREAM_REF_COUNT_BITS\t%d\n" , REF_COUNT_BITS );
+	}
+
+	if (segmentCount) writeSegmentTables( source , header );
+
+	if (keyFrameInterval) writeKeyFrameTables( source , header );
+
+	if (c->writeTables) c->writeTables( source , header );
+
+	fclose(source);
+	fclose(header);
+}
+
+static void writeFrames( FILE *f ) {
+	for( int n = 0 ; n < frameCount ; n++ ) {
+		fprintf( f , "# frame %d\n" , n );
+		for( int y = 0 ; y < HEIGHT ; y++ ) {
+			for( int x = 0 ; x < WIDTH ; x++ ) {
+				fprintf( f , "%s%2d" , x ? " " : "" , frames[n][(y*WIDTH)+x] );
+			}
+			fprintf( f , "\n" );
+		}
+		fprintf( f , "\n" );
+	}
+}
+
+// *** Encoding and measuring
+
+// Frame headers
+//
+// With -r or -H, every frame starts with a header. 0 means a normally coded frame follows. Otherwise...
+//
+//		-r only		1			reference
+//		-H only		1			hold
+//		both		1 0			reference
+//					1 1			hold
+//
+// Frame references (-r) are followed by the bit offset of an earlier run of normally coded frames (refOffsetBits wide) and
+// how many of them to replay (REF_COUNT_BITS wide). The decoder jumps back and decodes them again on top of whatever is on the
+// display now, so the encoder replays them the same way to see what they would show. Lossy, that only has to be close enough.
+//
+// Holds (-H) are followed by HOLD_BITS saying how many more frames after this one to keep showing the previous frame.
+// The decoder does no decoding at all for any of them.
+
+static void putRefHeader( bitstream *s ) {
+	putBit( s , 1 );
+	if (frameHolds) putBit( s , 0 );
+}
+
+static void putHoldHeader( bitstream *s ) {
+	putBit( s , 1 );
+	if (frameRefs) putBit( s , 1 );
+}
+
+// Bits it costs to code these frames normally, for deciding if a reference or hold is worth it
+static long codedBits( const codec *c , int n , int len , const byte *prev ) {
+	static bitstream trial;
+	byte p[FDA_SIZE];
+
+	memcpy( p , prev , FDA_SIZE );
+	memset( &trial , 0 , sizeof(trial) );
+
+	for( int i = 0 ; i < len ; i++ ) {
+		c->encode( &trial , p , frames[n+i] );
+		memcpy( p , frames[n+i] , FDA_SIZE );
+	}
+
+	return trial.bits + len;		// Plus the header bits
+}
+
+static int bitsNeeded( long value ) {
+	int n = 1;
+	while ( (value>>n) > 0 ) n++;
+	return n;
+}
+
+// Could (shown) stand in for frame (n)? Exactly the same, or when lossy, no further off what was asked for than quantizeFrames() went.
+static int closeEnough( const byte *shown , int n ) {
+	if (!memcmp( shown , frames[n] , FDA_SIZE )) return 1;
+	if (!lossy) return 0;
+
+	for( int i = 0 ; i < FDA_SIZE ; i++ ) {
+		if (lightnessError[ shown[i] ][ sourceFrames[n][i] ] > shownError) return 0;
+	}
+
+	return 1;
+}
+
+// Longest run of frames starting at (n) and ending before (end) that replaying an earlier run of normally coded frames from
+// (frameStart) in (s) on top of (prev) would show close enough, returning where it starts in *from and what it shows in (shown).
+// The last frame has to come out exactly, so the display is left just as coding the frames would have left it.
+static int findReference( const codec *c , const bitstream *s , const long *frameStart , int n , int end , const byte *coded , const byte *prev , int *from , byte (*shown)[FDA_SIZE] ) {
+	static byte trial[1<<REF_COUNT_BITS][FDA_SIZE];
+	decodestats stats;
+	int best = 0;
+
+	for( int m = 0 ; m < n ; m++ ) {
+		if (!coded[m]) continue;
+
+		bitreader r = { s->data , (s->bits+7)/8 , frameStart[m] };
+		byte cur[FDA_SIZE];
+		memcpy( cur , prev , FDA_SIZE );
+
+		int len = 0 , exactLen = 0;
+		while ( n+len < end && m+len < n && len < (1<<REF_COUNT_BITS)-1 && coded[m+len] ) {
+			getBit( &r );								// Header saying it is a normally coded frame
+			int savedQuiet = quiet , ok;
+			quiet = 1;									// Replaying on top of something else can run a pixel out of range, that just rules it out
+			ok = c->decode( &r , cur , &stats );
+			quiet = savedQuiet;
+			if (!ok || !closeEnough( cur , n+len )) break;
+			memcpy( trial[len++] , cur , FDA_SIZE );
+			if (!memcmp( cur , frames[n+len-1] , FDA_SIZE )) exactLen = len;
+		}
+
+		if (exactLen>best) {
+			best = exactLen;
+			*from = m;
+			memcpy( shown , trial , (size_t) best * FDA_SIZE );
+		}
+	}
+
+	return best;
+}
+
+static void encodeStream( const codec *c , bitstream *s ) {
+	static long frameStart[MAX_FRAMES];		// Bit offset of each normally coded frame's header bit
+	static byte coded[MAX_FRAMES];			// Was this frame coded normally (so it can be referenced)?
+	byte prev[FDA_SIZE] = {0};				// nextFrame() starts each loop from a blank fda[]
+
+	// Size offsets from the stream with no references. -r adds a header bit to every frame, and a reference is only used when
+	// it is shorter than coding the frame, so the stream with them is at most one bit per frame longer than that.
+
+	if (frameRefs) {
+		int saved = frameRefs , savedQuiet = quiet;
+		frameRefs = 0;
+		quiet = 1;
+		encodeStream( c , s );
+		frameRefs = saved;
+		quiet = savedQuiet;
+		refOffsetBits = bitsNeeded( s->bits + frameCount );
+	}
+
+	memset( s , 0 , sizeof(*s) );
+	memset( coded , 0 , sizeof(coded) );
+
+	int refs = 0 , refFrames = 0 , holds = 0 , holdFrames = 0;
+	int headerBits = 1 + (frameRefs && frameHolds);		// For a reference or hold
+	int end = 0;						// Holds and references stop at the next keyframe, since nextFrame() may start or jump there
+
+	for( int n = 0 ; n < frameCount ; ) {
+		if (keyFrame[n]) {
+			memset( prev , UNKNOWN_BRIGHTNESS , FDA_SIZE );
+			if (s->bits > 0xffff) {
+				fprintf( stderr , "Keyframe %d is at bit %ld, too far in for 16 bit offsets\n" , n , s->bits );
+				exit(1);
+			}
+			keyFrameOffset[n] = s->bits;
+		}
+
+		if (n >= end) {
+			end = n+1;
+			while ( end < frameCount && !keyFrame[end] ) end++;
+		}
+
+		if (frameHolds) {
+			int len = 0;
+			while ( n+len < end && len < (1<<HOLD_BITS) && !memcmp( frames[n+len] , prev , FDA_SIZE ) ) len++;
+
+			if ( len && headerBits+HOLD_BITS < codedBits( c , n , len , prev ) ) {
+				putHoldHeader( s );
+				putBits( s , (unsigned) len-1 , HOLD_BITS );
+				n += len;
+				holds++;
+				holdFrames += len;
+				continue;
+			}
+		}
+
+		if (frameRefs && !keyFrame[n]) {
+			static byte shown[1<<REF_COUNT_BITS][FDA_SIZE];
+			int from = 0;
+			int len = findReference( c , s , frameStart , n , end , coded , prev , &from , shown );
+
+			if (len) {								// Worth it? Compare against just coding those frames
+				if ( headerBits+refOffsetBits+REF_COUNT_BITS < codedBits( c , n , len , prev ) ) {
+					putRefHeader( s );
+					putBits( s , (unsigned) frameStart[from] , refOffsetBits );
+					putBits( s , (unsigned) len , REF_COUNT_BITS );
+					memcpy( frames[n] , shown , (size_t) len * FDA_SIZE );		// What the decoder will really show, if only close enough
+					memcpy( prev , frames[n+len-1] , FDA_SIZE );
+					n += len;
+					refs++;
+					refFrames += len;
+					continue;
+				}
+			}
+		}
+
+		if (frameRefs) {
+			frameStart[n] = s->bits;
+			coded[n] = 1;
+		}
+
+		if (frameRefs || frameHolds) putBit( s , 0 );
+
+		c->encode( s , prev , frames[n] );
+		memcpy( prev , frames[n] , FDA_SIZE );
+		n++;
+	}
+
+	if (quiet) return;
+
+	if (frameRefs) fprintf( stderr , "  %d frame references replay %d frames\n" , refs , refFrames );
+	if (frameHolds) fprintf( stderr , "  %d holds cover %d frames\n" , holds , holdFrames );
+}
+
+// Decode up to (count) frames into (out) on top of (initial), or a blank display if NULL, filling in (stats) for each one.
+// Returns how many frames were decoded.
+static int decodeStream( const codec *c , bitreader *r , const byte *initial , int count , byte (*out)[FDA_SIZE] , decodestats *stats ) {
+	byte cur[FDA_SIZE] = {0};
+	if (initial) memcpy( cur , initial , FDA_SIZE );
+	int n;
+	int replayLeft = 0;				// Frames left to replay from a reference
+	long returnPos = -1;			// Where to carry on after the replay
+	int holdLeft = 0;				// Frames left to keep showing the same thing
+
+	for( n = 0 ; n < count ; n++ ) {
+		long start = r->pos;
+		memset( &stats[n] , 0 , sizeof(stats[n]) );
+
+		if (holdLeft) {
+			holdLeft--;
+			memcpy( out[n] , cur , FDA_SIZE );
+			continue;
+		}
+
+		if (frameRefs || frameHolds) {
+			if (returnPos>=0 && !replayLeft) {
+				r->pos = returnPos;
+				returnPos = -1;
+				start = r->pos;
+			}
+
+			int bit = getBit( r );
+			if (bit<0) break;
+
+			int hold = bit && frameHolds;
+
+			if (bit && frameRefs && frameHolds) {
+				hold = getBit( r );
+				if (hold<0) break;
+			}
+
+			if (hold) {
+				if (!getBits( r , HOLD_BITS , &holdLeft )) break;
+				stats[n].bits = r->pos - start;
+				stats[n].tokens++;
+				memcpy( out[n] , cur , FDA_SIZE );
+				continue;
+			}
+
+			if (bit) {
+				int offset , len;
+				if (!getBits( r , refOffsetBits , &offset ) || !getBits( r , REF_COUNT_BITS , &len )) break;
+				if ( offset >= r->pos || !len ) {
+					fprintf( stderr , "Bad frame reference to bit %d for %d frames at bit %ld\n" , offset , len , r->pos );
+					break;
+				}
+				returnPos = r->pos;
+				replayLeft = len;
+				r->pos = offset;
+				stats[n].tokens++;
+				if (getBit( r ) != 0) {
+					fprintf( stderr , "Frame reference to bit %d does not point at a normally coded frame\n" , offset );
+					break;
+				}
+			}
+
+			if (replayLeft) replayLeft--;
+		}
+
+		long headerBits = (r->pos >= start) ? r->pos - start : 1+(frameRefs && frameHolds)+refOffsetBits+REF_COUNT_BITS+1;		// Reader jumps back on a reference
+		long decodeStart = r->pos;
+
+		if (!c->decode( r , cur , &stats[n] )) {
+			r->pos = (returnPos>=0) ? returnPos : start;			// Leave the reader at the end of the last complete frame
+			break;
+		}
+
+		stats[n].bits = headerBits + r->pos - decodeStart;
+		memcpy( out[n] , cur , FDA_SIZE );
+	}
+
+	if (returnPos>=0) r->pos = returnPos;
+
+	return n;
+}
+
+typedef struct {
+	long bits;
+	long bytes;
+	long minBits, maxBits;
+	long meanCycles, maxCycles;
+} streamreport;
+
+// Encode with (c), check it decodes back to exactly the source frames, and summarize what it cost
+static void measureStream( const codec *c , bitstream *s , streamreport *rep , int verbose ) {
+	static byte check[MAX_FRAMES][FDA_SIZE];
+	static decodestats stats[MAX_FRAMES];
+
+	if (c->prepare) c->prepare();
+
+	encodeStream( c , s );
+
+	bitreader r = { s->data , (s->bits+7)/8 , 0 };
+
+	if ( decodeStream( c , &r , NULL , frameCount , check , stats ) != frameCount || memcmp( check , frames , (size_t) frameCount * FDA_SIZE ) ) {
+		fprintf( stderr , "Internal error: %s stream does not decode back to the source frames\n" , c->name );
+		exit(1);
+	}
+
+	// Every way nextFrame() can go from one segment to another has to play the next segment right too
+
+	for( int a = 0 ; a < segmentCount ; a++ ) {
+		for( int i = 0 ; i < segmentNextCount[a] ; i++ ) {
+			int b = segmentNext[a][i];
+			int len = segmentStart[b+1]-segmentStart[b];
+			static decodestats joinStats[MAX_FRAMES];
+			bitreader j = { s->data , (s->bits+7)/8 , keyFrameOffset[ segmentStart[b] ] };
+
+			if ( decodeStream( c , &j , frames[ segmentStart[a+1]-1 ] , len , check , joinStats ) != len || memcmp( check , frames[ segmentStart[b] ] , (size_t) len * FDA_SIZE ) ) {
+				fprintf( stderr , "Internal error: %s segment %d does not play right after segment %d\n" , c->name , b , a );
+				exit(1);
+			}
+		}
+	}
+
+	// Same for starting at any keyframe, whatever was on the display before
+
+	for( int n = 0 ; n < frameCount ; n++ ) {
+		if (!keyFrame[n] || segmentCount) continue;
+
+		int len = 1;
+		while ( n+len < frameCount && !keyFrame[n+len] ) len++;
+
+		static decodestats keyStats[MAX_FRAMES];
+		bitreader k = { s->data , (s->bits+7)/8 , keyFrameOffset[n] };
+
+		if ( decodeStream( c , &k , frames[ (n + frameCount/2) % frameCount ] , len , check , keyStats ) != len || memcmp( check , frames[n] , (size_t) len * FDA_SIZE ) ) {
+			fprintf( stderr , "Internal error: %s does not play right from keyframe %d\n" , c->name , n );
+			exit(1);
+		}
+	}
+
+	memset( rep , 0 , sizeof(*rep) );
+	rep->bits = s->bits;
+	rep->bytes = (s->bits+7)/8;
+	if (c->writeTables) rep->bytes += c->writeTables( NULL , NULL );
+	if (segmentCount) rep->bytes += writeSegmentTables( NULL , NULL );
+	if (keyFrameInterval) rep->bytes += writeKeyFrameTables( NULL , NULL );
+	rep->minBits = -1;
+
+	long totalCycles = 0;
+
+	for( int n = 0 ; n < frameCount ; n++ ) {
+		long cycles = estimateCycles( c , &stats[n] );
+		if (verbose) {
+			FILE *f = lossy ? stdout : stderr;			// The quality report is the point of a lossy encode, so it goes to stdout
+			fprintf( f , "frame %4d: %4ld bits, %2ld changed pixels, ~%5ld decode cycles" , n , stats[n].bits , stats[n].literals , cycles );
+			if (lossy) {
+				double maxError , meanError;
+				frameError( n , &maxError , &meanError );
+				fprintf( f , ", error max %4.1f mean %4.2f" , maxError , meanError );
+			}
+			fprintf( f , "\n" );
+		}
+		if (rep->minBits<0 || stats[n].bits<rep->minBits) rep->minBits = stats[n].bits;
+		if (stats[n].bits>rep->maxBits) rep->maxBits = stats[n].bits;
+		if (cycles>rep->maxCycles) rep->maxCycles = cycles;
+		totalCycles += cycles;
+	}
+
+	rep->meanCycles = totalCycles / frameCount;
+}
+
+static void printReport( const codec *c , const streamreport *rep ) {
+	fprintf( stderr , "%-14s %d frames, %ld bits (%.1f bits/frame, min %ld, max %ld), %ld bytes of flash, ~%ld decode cycles/frame (max ~%ld)\n" ,
+		c->name , frameCount , rep->bits , (double) rep->bits / frameCount , rep->minBits , rep->maxBits , rep->bytes , rep->meanCycles , rep->maxCycles );
+}
+
+// *** Benchmark
+
+// One CSV line per format for the clip in (filename), encoded with the -H/-r/-g/-e options in (options)
+static void benchClip( const char *filename , const char *options , double maxError ) {
+	static bitstream s;
+	streamreport rep;
+
+	frameCount = 0;
+	readFrames( filename );
+
+	if (lossy) {
+		memcpy( sourceFrames , frames , sizeof(frames) );
+		quantizeFrames( maxError );
+	}
+
+	if (segmentLength) findSegments();
+	if (keyFrameInterval) markKeyFrames();
+
+	const char *slash = strrchr( filename , '/' );
+	const char *name = slash ? slash+1 : filename;
+	int nameLength = (int) strcspn( name , "." );
+
+	static byte quantized[MAX_FRAMES][FDA_SIZE];
+	memcpy( quantized , frames , sizeof(frames) );
+
+	for( int i = 0 ; i < CODEC_COUNT ; i++ ) {
+		memcpy( frames , quantized , sizeof(frames) );		// Lossy frame references change frames[] to what gets shown
+		measureStream( &codecs[i] , &s , &rep , 0 );
+		printf( "%.*s,%s,%s,%d,%ld,%.1f\n" , nameLength , name , codecs[i].name , options , frameCount , rep.bytes , (double) rep.bits / frameCount );
+	}
+}
+
+// *** Main
+
+static void usage(void) {
+	fprintf( stderr ,
+		"usage: VideoEncoder [-f format] [-o dir] [-v] framesfile      encode frames into dir/VideoBitStream.c and dir/VideoBitstream.h\n"
+		"       VideoEncoder [-f format] -d VideoBitStream.c [-n count]  decode a stream back into frames on stdout\n"
+		"       VideoEncoder -B [-H] [-r] [-g frames] [-e error] framesfile...  CSV of every format on each clip on stdout\n"
+		"       VideoEncoder -S kind [-n count]                          write a synthetic clip (calm, gusty or dark) on stdout\n"
+		"\n"
+		"  -f format bitstream format, must match BITSTREAM_FORMAT in candle.h (default classic)\n"
+		"  -o dir    where to write the generated source (default .)\n"
+		"  -e error  lossy: let pixels be up to this far off in CIE lightness (0-100, one brightness step is about 3)\n"
+		"  -D        for firmware built with DITHER in candle.h, moves every pixel to the dithered brightness that looks most like it\n"
+		"  -b bytes  lossy: smallest error that fits the stream and its tables into this much flash\n"
+		"  -k frames put a keyframe this often, so nextFrame() can start at any of them (for EEPROM_RESUME)\n"
+		"  -g frames cut the clip into segments about this long that nextFrame() strings together at random instead of looping\n"
+		"  -H        code runs of identical frames as a hold count so the decoder can skip them\n"
+		"  -r        let frames refer back to an earlier run that replays the same (close enough, when lossy) instead of coding them again\n"
+		"  -s scan   scan order for -f spatial: rows, columns or serpentine (default is whichever is smallest)\n"
+		"  -v        report bits and estimated decode cycles for every frame, not just the totals (always on stdout when lossy)\n"
+		"  -n count  number of frames to decode or generate (default is as many as the data holds, or 300)\n"
+	);
+	exit(1);
+}
+
+int main( int argc , char **argv ) {
+	const codec *c = &codecs[0];
+	const char *outDir = ".";
+	const char *decodeFile = NULL;
+	int verbose = 0;
+	int decodeCount = 0;
+	double maxError = -1;
+	long targetBytes = 0;
+	const char *clipKind = NULL;
+	int bench = 0;
+	char options[64] = "";			// The options that change the stream, for the benchmark
+	int opt;
+
+	while ( (opt=getopt( argc , argv , "f:o:d:n:rs:vHg:e:b:BS:k:D" )) != -1 ) {
+		switch (opt) {
+			case 's':
+				for( int i = 0 ; i < SCAN_COUNT ; i++ ) if (!strcmp( optarg , scanNames[i] )) forcedScan = i;
+				if (forcedScan<0) usage();
+				break;
+			case 'f': c = findCodec( optarg ); break;
+			case 'o': outDir = optarg; break;
+			case 'd': decodeFile = optarg; break;
+			case 'n': decodeCount = atoi( optarg ); break;
+			case 'r': frameRefs = 1; break;
+			case 'H': frameHolds = 1; break;
+			case 'D': dither = 1; break;
+			case 'B': bench = 1; break;
+			case 'k':
+				keyFrameInterval = atoi( optarg );
+				if (keyFrameInterval<2) usage();
+				break;
+			case 'S': clipKind = optarg; break;
+			case 'e': maxError = atof( optarg ); lossy = 1; break;
+			case 'b': targetBytes = atol( optarg ); lossy = 1; break;
+			case 'g':
+				segmentLength = atoi( optarg );
+				if (segmentLength<2 || segmentLength>170) {
+					fprintf( stderr , "-g must be 2-170 frames so segments stay under 256 frames\n" );
+					exit(1);
+				}
+				break;
+			case 'v': verbose = 1; break;
+			default: usage();
+		}
+
+		if ( strchr( "rHgekD" , opt ) ) {
+			snprintf( options + strlen(options) , sizeof(options) - strlen(options) , "%s-%c%s%s" , options[0] ? " " : "" , opt , optarg ? " " : "" , optarg ? optarg : "" );
+		}
+	}
+
+	if (dither && !lossy) {			// The source levels still have to be moved onto the dithered ones, as near as they go
+		lossy = 1;
+		maxError = 0;
+	}
+
+	if (keyFrameInterval && segmentLength) {
+		fprintf( stderr , "-k and -g do not go together, segments already start with keyframes\n" );
+		return 1;
+	}
+
+	if (clipKind) {
+		generateClip( clipKind , decodeCount );
+		fprintf( stdout , "# Synthetic %s clip made by VideoEncoder -S %s -n %d\n\n" , clipKind , clipKind , frameCount );
+		writeFrames( stdout );
+		return 0;
+	}
+
+	if (bench) {
+		if (optind == argc || targetBytes) usage();
+		if (lossy) makeLightnessErrors();
+		quiet = 1;
+		printf( "clip,format,options,frames,flash_bytes,bits_per_frame\n" );
+		for( int i = optind ; i < argc ; i++ ) benchClip( argv[i] , options , maxError );
+		return 0;
+	}
+
+	if (decodeFile) {
+		static byte data[MAX_STREAM_BYTES];
+		static decodestats stats[MAX_FRAMES];
+		bitreader r = { data , readArray( decodeFile , "videobitstream" , data , MAX_STREAM_BYTES ) , 0 };
+
+		if (!r.len) {
+			fprintf( stderr , "%s: videobitstream[] is empty\n" , decodeFile );
+			return 1;
+		}
+
+		if (c->readTables) c->readTables( decodeFile );
+
+		if (readHeaderDefine( decodeFile , "VIDEOBITSTREAM_HOLDS" )) frameHolds = 1;
+
+		if (readHeaderDefine( decodeFile , "VIDEOBITSTREAM_FRAME_REFERENCES" )) {
+			frameRefs = 1;
+			refOffsetBits = atoi( readHeaderDefine( decodeFile , "VIDEOBITSTREAM_REF_OFFSET_BITS" ) );
+		}
+
+		frameCount = decodeStream( c , &r , NULL , decodeCount ? decodeCount : MAX_FRAMES , frames , stats );
+
+		if (decodeCount && frameCount < decodeCount) {
+			fprintf( stderr , "%s: data ran out after %d frames\n" , decodeFile , frameCount );
+			return 1;
+		}
+
+		writeFrames( stdout );
+		fprintf( stderr , "Decoded %d frames from %ld bytes (%ld bits used)\n" , frameCount , r.len , r.pos );
+		return 0;
+	}
+
+	if (optind != argc-1) usage();
+
+	readFrames( argv[optind] );
+
+	static bitstream s;
+	streamreport rep;
+
+	if (lossy) {
+		memcpy( sourceFrames , frames , sizeof(frames) );
+		makeLightnessErrors();
+		verbose = 1;
+
+		if (targetBytes) {					// Size only goes down as the error goes up (near enough), so home in on it
+			double lo = 0 , hi = 100;
+			quiet = 1;
+			while ( hi-lo > 0.05 ) {
+				double mid = (lo+hi)/2;
+				quantizeFrames( mid );
+				if (segmentLength) findSegments();
+				if (keyFrameInterval) markKeyFrames();
+				measureStream( c , &s , &rep , 0 );
+				if (rep.bytes > targetBytes) lo = mid; else hi = mid;
+			}
+			quiet = 0;
+			maxError = hi;
+		}
+
+		quantizeFrames( maxError );
+		if (maxError > 0) fprintf( stderr , "  showing pixels up to %.1f off in lightness\n" , maxError );
+		else fprintf( stderr , "  showing each pixel at the nearest dithered brightness\n" );
+	}
+
+	if (segmentLength) findSegments();
+	if (keyFrameInterval) markKeyFrames();
+
+	if (c != &codecs[0]) {			// Show the classic format too so we can see what we saved
+		static byte quantized[MAX_FRAMES][FDA_SIZE];
+		streamreport classic;
+		memcpy( quantized , frames , sizeof(frames) );		// Lossy frame references change frames[] to what gets shown
+		measureStream( &codecs[0] , &s , &classic , 0 );
+		memcpy( frames , quantized , sizeof(frames) );
+		printReport( &codecs[0] , &classic );
+	}
+
+	measureStream( c , &s , &rep , verbose );
+
+	writeSource( outDir , &s , c );
+
+	printReport( c , &rep );
+
+	if (lossy) {
+		double worst = 0 , mean = 0;
+		long exact = 0;
+		for( int n = 0 ; n < frameCount ; n++ ) {
+			double maxError , meanError;
+			frameError( n , &maxError , &meanError );
+			if (maxError > worst) worst = maxError;
+			mean += meanError / frameCount;
+			for( int i = 0 ; i < FDA_SIZE ; i++ ) exact += frames[n][i]==sourceFrames[n][i];
+		}
+		fprintf( stderr , "%-14s error max %.1f mean %.2f, %.1f%% of pixels exact\n" , "" , worst , mean , 100.0 * exact / ((long) frameCount * FDA_SIZE) );
+
+		if (targetBytes && rep.bytes > targetBytes) {
+			fprintf( stderr , "Could not get down to %ld bytes\n" , targetBytes );
+			return 1;
+		}
+	}
+
+	return 0;
+}
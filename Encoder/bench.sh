@@ -0,0 +1,25 @@
+#!/bin/sh
+#
+# bench.sh - encode every clip in the corpus in every format, with each set of stream options, and print the
+# results as CSV on stdout. bench.csv is the last run that was checked in, so...
+#
+#	./bench.sh | diff bench.csv -
+#
+# ...shows any change that makes a format bigger. There are no decode cycle columns, since VideoEncoder only has a rough
+# per-format cost model (what -v prints) and nothing here runs nextFrame() on an AVR. Refresh and frame rates are not
+# in here either, since they depend on the board and not the clip. PA0 pulses once per refresh in a DEBUG build
+# (TIMECHECK), so put a scope or counter on that pin to see how close the watchdog or TIMER1_WAKE really gets.
+#
+# The corpus is flame.frames (the shipped videobitstream[] decoded back to frames) plus the synthetic clips in
+# corpus/, which were made with VideoEncoder -S.
+
+cd "$(dirname "$0")" || exit 1
+
+ENCODER="${TMPDIR:-/tmp}/VideoEncoder-bench.$$"
+trap 'rm -f "$ENCODER"' EXIT
+
+gcc -O2 -Wall -pthread -o "$ENCODER" VideoEncoder.c -lm || exit 1
+
+for options in "" "-H" "-r -H" "-g 32" "-e 4"; do
+	"$ENCODER" -B $options flame.frames corpus/*.frames || exit 1
+done | awk 'NR==1 || !/^clip,/'